@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 typedef struct posix_header
 {                       /* byte offset */
@@ -58,6 +59,21 @@ typedef struct posix_header
  */
 int check_archive(int tar_fd);
 
+/**
+ * Checks whether the archive at the given path is valid, as check_archive() does, without filling the page cache.
+ *
+ * The archive is opened with O_DIRECT and read in large aligned buffers, one being read while the previous one is
+ * checked, so that a full scan runs at the bandwidth of the device without evicting the pages other processes use.
+ * On file systems which do not support O_DIRECT, the pages read are dropped from the page cache instead.
+ *
+ * @param path The path of a file supposed to contain a tar archive.
+ *
+ * @return the same values as check_archive(), -3 also if the size of an entry is negative or runs past the end
+ *         of the archive,
+ *         -4 if the archive could not be opened or read.
+ */
+int check_archive_direct(const char *path);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -86,7 +102,7 @@ int is_dir(int tar_fd, char *path);
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file nor a hard link to a file,
  *         any other value otherwise.
  */
 int is_file(int tar_fd, char *path);
@@ -130,7 +146,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  * Reads a file at a given path in the archive.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink or a hard link, it must be resolved to its linked-to entry.
  * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
  * @param dest A destination buffer to read the given file into.
  * @param len An in-out argument.
@@ -146,4 +162,258 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Reads a file at a given path in the archive into several buffers with a single system call.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink or a hard link, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param iov An array of buffers, filled in order as by preadv().
+ * @param iovcnt The number of buffers in iov.
+ * @param len An out argument.
+ *            The callee set it to the number of bytes written to the buffers.
+ *
+ * @return the same values as read_file(), the destination being the concatenation of the buffers,
+ *         -1 also if iovcnt is negative or greater than IOV_MAX.
+ */
+ssize_t read_file_v(int tar_fd, char *path, size_t offset, const struct iovec *iov, int iovcnt, size_t *len);
+
+/**
+ * Copies a file at a given path in the archive to another file descriptor, at its current offset.
+ *
+ * The content is moved by the kernel, with splice(), copy_file_range() or sendfile() depending on the
+ * type of out_fd, and is only copied into user space if the kernel does not support it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink or a hard link, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param out_fd A file descriptor to write the file to, e.g. a pipe, a socket or a regular file.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes to copy.
+ *            The callee set it to the number of bytes copied.
+ *
+ * @return the same values as read_file(),
+ *         -1 also if nothing could be written to out_fd, errno being set accordingly.
+ */
+ssize_t read_file_to_fd(int tar_fd, char *path, size_t offset, int out_fd, size_t *len);
+
+/**
+ * A handle on an archive together with an in-memory index of its entries.
+ *
+ * As with extracting an archive, when several entries share the same path, the last one shadows the earlier ones.
+ * The handle does not move the file offset of the underlying file descriptor.
+ */
+typedef struct tar_index tar_index_t;
+
+/* Flags of tar_index_open() */
+#define TAR_INDEX_LAZY 1  /* Validate the headers on first access instead of when opening */
+#define TAR_INDEX_CACHE 2 /* Cache the content of the small entries that are read */
+
+/**
+ * Builds an index of the entries of an archive.
+ *
+ * By default, every header is validated as in check_archive() while the index is built.
+ * With TAR_INDEX_LAZY, a header is only validated the first time a lookup reaches it, and the result is remembered.
+ * The lookups then return -1, -2 or -3 as in check_archive() when they reach an invalid header.
+ * The size of every header is still checked while the index is built, as the next header is found from it.
+ *
+ * Hard links are resolved to the content of their target while the index is built.
+ * With TAR_INDEX_CACHE, the content of the small entries that are read is kept in memory,
+ * and reading any of the hard links to an entry hits the same cached content.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file. It must stay open until the handle is closed.
+ * @param flags Zero or more of TAR_INDEX_LAZY and TAR_INDEX_CACHE, combined with a bitwise or.
+ *
+ * @return a handle on the archive,
+ *         NULL if the archive contains an invalid header, could not be read or the index could not be allocated.
+ */
+tar_index_t *tar_index_open(int tar_fd, int flags);
+
+/**
+ * Indexes the entries appended to the archive since the handle was opened or last refreshed.
+ *
+ * Only the part of the archive after the previously recorded end-of-archive marker is parsed,
+ * so the cost of a refresh is proportional to the number of appended bytes.
+ * An entry is only indexed once the file extends past its content by at least one block, where its end-of-archive
+ * marker goes, and is otherwise left for a later refresh. In an archive padded past its end-of-archive marker,
+ * this already holds when the header alone is written, so a writer appending to such an archive while it is
+ * refreshed must write the content of an entry before its header.
+ *
+ * @param index A handle returned by tar_index_open().
+ *
+ * @return a zero or positive value representing the number of entries added to the index,
+ *         -1, -2 or -3 if an appended header is invalid, as in check_archive(), -3 also if its size is negative,
+ *         -4 if the archive could not be read or the index could not be allocated.
+ */
+int tar_index_refresh(tar_index_t *index);
+
+/**
+ * Releases a handle. The underlying file descriptor is left open.
+ *
+ * @param index A handle returned by tar_index_open(), or NULL.
+ */
+void tar_index_close(tar_index_t *index);
+
+/**
+ * Same as exists(), on an indexed archive.
+ * All the tar_index_* lookups below return -1, -2 or -3 if they reach an invalid header (see TAR_INDEX_LAZY),
+ * and -4 if they cannot read a header they reach.
+ * For tar_index_read_file(), these values overlap with its own -1 and -2 error codes.
+ */
+int tar_index_exists(tar_index_t *index, char *path);
+
+/**
+ * Same as is_dir(), on an indexed archive.
+ */
+int tar_index_is_dir(tar_index_t *index, char *path);
+
+/**
+ * Same as is_file(), on an indexed archive.
+ */
+int tar_index_is_file(tar_index_t *index, char *path);
+
+/**
+ * Same as is_symlink(), on an indexed archive.
+ */
+int tar_index_is_symlink(tar_index_t *index, char *path);
+
+/**
+ * Same as list(), on an indexed archive.
+ * Returns -4 if the sorted path table could not be allocated.
+ */
+int tar_index_list(tar_index_t *index, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Same as read_file(), on an indexed archive.
+ */
+ssize_t tar_index_read_file(tar_index_t *index, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Same as read_file_v(), on an indexed archive.
+ */
+ssize_t tar_index_read_file_v(tar_index_t *index, char *path, size_t offset, const struct iovec *iov, int iovcnt, size_t *len);
+
+/**
+ * Same as read_file_to_fd(), on an indexed archive.
+ */
+ssize_t tar_index_read_file_to_fd(tar_index_t *index, char *path, size_t offset, int out_fd, size_t *len);
+
+/* Flags of tar_find_prefix() and tar_glob() */
+#define TAR_ARCHIVE_ORDER 1 /* List the entries in archive order instead of lexical order */
+
+/**
+ * Lists the entries whose path starts with the given prefix, recursively.
+ *
+ * Only the part of the sorted path table of the index holding the prefix is visited.
+ *
+ * @param index A handle returned by tar_index_open().
+ * @param prefix A path prefix, e.g. "dir1/" or "dir1/file".
+ * @param flags Zero to list the entries in lexical order, TAR_ARCHIVE_ORDER to list them in archive order.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return the number of entries listed,
+ *         -1, -2 or -3 if a listed entry has an invalid header (see TAR_INDEX_LAZY),
+ *         -4 if the sorted path table could not be allocated.
+ */
+int tar_find_prefix(tar_index_t *index, char *prefix, int flags, char **entries, size_t *no_entries);
+
+/**
+ * Lists the entries whose path matches a glob pattern.
+ *
+ * `?` matches any character but a slash, `*` matches any sequence of characters without a slash,
+ * and `**` matches any sequence of characters, slashes included; when followed by a slash, it may also match no directory.
+ * The trailing slash of a directory is not matched, so a pattern ending with a slash and a star lists the content
+ * of a directory but not the directory itself.
+ * A pattern ending with a slash only matches directories.
+ * Only the part of the sorted path table holding the literal prefix of the pattern, before its first wildcard, is visited.
+ *
+ * @param index A handle returned by tar_index_open().
+ * @param pattern A glob pattern.
+ * @param flags Zero to list the entries in lexical order, TAR_ARCHIVE_ORDER to list them in archive order.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return the number of entries listed,
+ *         -1, -2 or -3 if a listed entry has an invalid header (see TAR_INDEX_LAZY),
+ *         -4 if the sorted path table could not be allocated.
+ */
+int tar_glob(tar_index_t *index, char *pattern, int flags, char **entries, size_t *no_entries);
+
+/**
+ * A handle on an archive that can be replaced while it is being read, see tar_swap_open().
+ */
+typedef struct tar_swap tar_swap_t;
+
+/**
+ * Opens an archive that can be replaced by a new one while it is being read.
+ *
+ * The archive and its index form a version. Readers access the current version without taking any lock,
+ * and a reload publishes a new version atomically: the reads in progress finish on the version they started on,
+ * which is released once no reader holds it anymore.
+ *
+ * @param path The path of a tar archive file.
+ *
+ * @return a handle on the archive,
+ *         NULL if the archive could not be opened, contains an invalid header or could not be indexed.
+ */
+tar_swap_t *tar_swap_open(const char *path);
+
+/**
+ * Replaces the archive of a handle by the archive currently at the given path.
+ *
+ * The new archive is opened and indexed by the calling thread, typically a background one, before being published.
+ * The call then waits until the readers that may hold the previous version are done, and releases it.
+ * Readers are never blocked by a reload. Concurrent reloads are serialized.
+ *
+ * @param swap A handle returned by tar_swap_open().
+ * @param path The path of a tar archive file, e.g. the path the previous archive was replaced at.
+ *
+ * @return zero if the new archive was published,
+ *         -1 if it could not be opened, contains an invalid header or could not be indexed, the previous one staying current.
+ */
+int tar_swap_reload(tar_swap_t *swap, const char *path);
+
+/**
+ * Releases a handle and its current version. No reader may use it anymore.
+ *
+ * @param swap A handle returned by tar_swap_open(), or NULL.
+ */
+void tar_swap_close(tar_swap_t *swap);
+
+/**
+ * Starts reading the current version of an archive, which stays valid until tar_swap_release() is called.
+ *
+ * The returned index is shared between readers and must only be passed to the tar_index_* lookups,
+ * not to tar_index_refresh() or tar_index_close().
+ *
+ * @param swap A handle returned by tar_swap_open().
+ * @param epoch An out argument, to pass to tar_swap_release().
+ *
+ * @return the index of the current version.
+ */
+tar_index_t *tar_swap_acquire(tar_swap_t *swap, int *epoch);
+
+/**
+ * Ends a read started with tar_swap_acquire().
+ *
+ * @param swap A handle returned by tar_swap_open().
+ * @param epoch The value set by tar_swap_acquire().
+ */
+void tar_swap_release(tar_swap_t *swap, int epoch);
+
+/**
+ * Same as read_file(), on the current version of an archive.
+ */
+ssize_t tar_swap_read_file(tar_swap_t *swap, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Same as list(), on the current version of an archive.
+ */
+int tar_swap_list(tar_swap_t *swap, char *path, char **entries, size_t *no_entries);
+
 #endif // __LIB_TAR_H__
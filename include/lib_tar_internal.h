@@ -1,9 +1,21 @@
 #ifndef __LIB_TAR_INTERNAL_H__
 #define __LIB_TAR_INTERNAL_H__
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "lib_tar.h"
 
@@ -28,6 +40,40 @@ int chksum(tar_header_t *header)
     return chksum;
 }
 
+/**
+ * Checks the magic value, the version and the checksum of a non-null header.
+ *
+ * @return 1 if the header is valid, or the corresponding check_archive() error code.
+ */
+int validate_header(tar_header_t *header)
+{
+    if (strncmp(header->magic, TMAGIC, TMAGLEN) != 0)
+        return -1;
+    if (strncmp(header->version, TVERSION, TVERSLEN) != 0)
+        return -2;
+    if (chksum(header) != TAR_INT(header->chksum))
+        return -3;
+    return 1;
+}
+
+/**
+ * Parses the size field of a header, which is not null-terminated if the header is corrupted.
+ *
+ * @return the size of the content of the entry, or -1 if the field does not hold a non-negative octal number.
+ */
+off_t header_size(tar_header_t *header)
+{
+    char field[sizeof(header->size) + 1];
+    memcpy(field, header->size, sizeof(header->size));
+    field[sizeof(header->size)] = '\0';
+
+    char *end;
+    long long size = strtoll(field, &end, 8);
+    if (end == field || size < 0)
+        return -1;
+    return size;
+}
+
 header_result_t *next_valid_header(int tar_fd)
 {
     int zero_blocks = 0;
@@ -54,30 +100,10 @@ header_result_t *next_valid_header(int tar_fd)
 
         tar_header_t *header = (tar_header_t *)buf;
 
-        if (strncmp(header->magic, TMAGIC, 6) != 0)
-        {
-            header_result_t *result = (header_result_t *)malloc(sizeof(header_result_t));
-            result->valid = -1;
-            return result;
-        }
-
-        if (strncmp(header->version, TVERSION, 2) != 0)
-        {
-            header_result_t *result = (header_result_t *)malloc(sizeof(header_result_t));
-            result->valid = -2;
-            return result;
-        }
-
-        if (chksum(header) != TAR_INT(header->chksum))
-        {
-            header_result_t *result = (header_result_t *)malloc(sizeof(header_result_t));
-            result->valid = -3;
-            return result;
-        }
-
         header_result_t *result = (header_result_t *)malloc(sizeof(header_result_t));
-        result->valid = 1;
-        result->header = *header;
+        result->valid = validate_header(header);
+        if (result->valid > 0)
+            result->header = *header;
         return result;
     }
 }
@@ -105,14 +131,41 @@ tar_header_t *get_header(int tar_fd, char *path)
         if (strcmp(header->name, path) == 0)
             return header;
         skip_file_content(tar_fd, header);
+        free(header_result);
     }
     return NULL;
 }
 
+/**
+ * Frees a header returned by get_header().
+ */
+void free_header(tar_header_t *header)
+{
+    if (header != NULL)
+        free((char *)header - offsetof(header_result_t, header));
+}
+
+// Maximum number of links followed when resolving a path
+#define INDEX_MAX_LINKS 40
+
+/**
+ * Resolves a symlink or a hard link to its linked-to entry.
+ * The headers met along the way are freed, but not the given one.
+ *
+ * @return the header of the resolved entry, or NULL if a link is broken or too many links are followed.
+ */
 tar_header_t *follow_symlinks(int tar_fd, tar_header_t *header)
 {
-    while (header->typeflag == SYMTYPE)
+    // Hard links are resolved the same way, get_header() leaving tar_fd at the content of their target
+    tar_header_t *followed = NULL;
+    for (int i = 0; header->typeflag == SYMTYPE || header->typeflag == LNKTYPE; i++)
     {
+        if (i == INDEX_MAX_LINKS)
+        {
+            free_header(followed);
+            lseek(tar_fd, 0, SEEK_SET);
+            return NULL;
+        }
 
         char link[strlen(header->linkname) + 1];
         strncpy(link, header->linkname, sizeof(link));
@@ -131,16 +184,1258 @@ tar_header_t *follow_symlinks(int tar_fd, tar_header_t *header)
             header = get_header(tar_fd, link_with_slash);
             if (header == NULL)
             {
+                free_header(followed);
                 lseek(tar_fd, 0, SEEK_SET);
                 return NULL;
             }
         }
 
-        if (header == NULL)
-            break;
+        free_header(followed);
+        followed = header;
     }
 
     return header;
 }
 
+/**
+ * Finds the content of the file at the given path, resolving links, and leaves tar_fd at the start of the archive.
+ *
+ * @return the offset of the content in the archive, or -1 if no file exists at the given path.
+ */
+off_t find_file_content(int tar_fd, char *path, size_t *size)
+{
+    tar_header_t *header = get_header(tar_fd, path);
+    if (header != NULL && (header->typeflag == SYMTYPE || header->typeflag == LNKTYPE))
+        header = follow_symlinks(tar_fd, header);
+
+    off_t content = lseek(tar_fd, 0, SEEK_CUR);
+    lseek(tar_fd, 0, SEEK_SET);
+    if (header == NULL || header->typeflag == DIRTYPE)
+        return -1;
+
+    *size = TAR_INT(header->size);
+    return content;
+}
+
+/**
+ * Clamps the length of a read from a file of the given size at the given offset.
+ *
+ * @return the number of bytes left to read past the clamped length.
+ */
+ssize_t clamp_read(size_t size, size_t offset, size_t *len)
+{
+    size_t read_size = size - offset;
+    if (read_size > *len)
+        return read_size - *len;
+    *len = read_size;
+    return 0;
+}
+
+size_t iovec_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/**
+ * Copies the buffers of an iovec array into dest, truncated to a total of at most len bytes.
+ *
+ * @return the number of buffers in dest.
+ */
+int clamp_iovec(const struct iovec *iov, int iovcnt, size_t len, struct iovec *dest)
+{
+    int count = 0;
+    for (; count < iovcnt && len > 0; count++)
+    {
+        dest[count] = iov[count];
+        if (dest[count].iov_len > len)
+            dest[count].iov_len = len;
+        len -= dest[count].iov_len;
+    }
+    return count;
+}
+
+/**
+ * Copies len bytes of the archive from the given offset to out_fd, at its current offset,
+ * without going through user space when the kernel allows it:
+ * splice() to a pipe, copy_file_range() to a regular file, sendfile() to anything else, e.g. a socket.
+ * Falls back to pread() and write() when the kernel does not support the copy.
+ *
+ * @return the number of bytes copied, or -1 if nothing could be copied.
+ */
+ssize_t copy_to_fd(int tar_fd, off_t from, size_t len, int out_fd)
+{
+    struct stat st;
+    if (fstat(out_fd, &st) == -1)
+        return -1;
+
+    int zero_copy = 1;
+    size_t done = 0;
+    while (done < len)
+    {
+        off_t in_offset = from + done;
+        ssize_t n;
+        if (zero_copy && S_ISFIFO(st.st_mode))
+            n = splice(tar_fd, &in_offset, out_fd, NULL, len - done, SPLICE_F_MOVE);
+        else if (zero_copy && S_ISREG(st.st_mode))
+            n = copy_file_range(tar_fd, &in_offset, out_fd, NULL, len - done, 0);
+        else if (zero_copy)
+            n = sendfile(out_fd, tar_fd, &in_offset, len - done);
+        else
+        {
+            uint8_t buf[64 * 1024];
+            n = pread(tar_fd, buf, len - done < sizeof(buf) ? len - done : sizeof(buf), in_offset);
+            if (n > 0)
+                n = write(out_fd, buf, n);
+        }
+
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (zero_copy && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF))
+            {
+                zero_copy = 0;
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+
+    if (done == 0 && len > 0)
+        return -1;
+    return done;
+}
+
+/**
+ * Reads the content of an entry into several buffers, for read_file_v() and tar_index_read_file_v().
+ *
+ * @param content The offset of the content of the entry in the archive.
+ * @param size The size of the content.
+ *
+ * @return the same values as read_file_v(), -1 also if iovcnt is negative or greater than IOV_MAX.
+ */
+ssize_t read_content_v(int tar_fd, off_t content, size_t size, size_t offset, const struct iovec *iov, int iovcnt, size_t *len)
+{
+    *len = 0;
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
+        return -1;
+    if (offset >= size)
+        return -2;
+
+    size_t iov_len = iovec_len(iov, iovcnt);
+    ssize_t remaining = clamp_read(size, offset, &iov_len);
+    struct iovec clamped[iovcnt > 0 ? iovcnt : 1];
+    iovcnt = clamp_iovec(iov, iovcnt, iov_len, clamped);
+
+    ssize_t n = preadv(tar_fd, clamped, iovcnt, content + offset);
+    if (n < 0)
+        return -1;
+    *len = n;
+    return remaining + (iov_len - n);
+}
+
+/**
+ * Copies the content of an entry to out_fd, for read_file_to_fd() and tar_index_read_file_to_fd().
+ *
+ * @param content The offset of the content of the entry in the archive.
+ * @param size The size of the content.
+ *
+ * @return the same values as read_file_to_fd().
+ */
+ssize_t read_content_to_fd(int tar_fd, off_t content, size_t size, size_t offset, int out_fd, size_t *len)
+{
+    if (offset >= size)
+        return -2;
+
+    ssize_t remaining = clamp_read(size, offset, len);
+    ssize_t n = copy_to_fd(tar_fd, content + offset, *len, out_fd);
+    if (n < 0)
+        return -1;
+    remaining += *len - n;
+    *len = n;
+    return remaining;
+}
+
+/**
+ * Direct scan
+ */
+
+// Size and alignment of the buffers of check_archive_direct(), which O_DIRECT requires to be block-aligned
+#define SCAN_BUFFER_SIZE (4 * 1024 * 1024)
+#define SCAN_ALIGNMENT 4096
+
+// Two buffers are read alternately by a reader thread while the other one is parsed.
+typedef struct
+{
+    int tar_fd;
+    int direct; // Whether tar_fd was opened with O_DIRECT, otherwise the pages read are dropped from the page cache
+    uint8_t *buffers[2];
+    ssize_t lengths[2];
+    sem_t filled[2];
+    sem_t empty[2];
+    atomic_int stop;
+} scan_t;
+
+void *scan_read(void *arg)
+{
+    scan_t *scan = (scan_t *)arg;
+    off_t offset = 0;
+    for (int i = 0;; i ^= 1)
+    {
+        while (sem_wait(&scan->empty[i]) == -1 && errno == EINTR)
+            ;
+        if (atomic_load(&scan->stop))
+            break;
+
+        ssize_t n = pread(scan->tar_fd, scan->buffers[i], SCAN_BUFFER_SIZE, offset);
+        if (n > 0 && !scan->direct)
+            posix_fadvise(scan->tar_fd, offset, n, POSIX_FADV_DONTNEED);
+        scan->lengths[i] = n;
+        sem_post(&scan->filled[i]);
+        if (n < SCAN_BUFFER_SIZE)
+            break;
+        offset += n;
+    }
+    return NULL;
+}
+
+/**
+ * Index
+ */
+
+// Size of a header followed by content of the given size, rounded up to the next block
+#define ENTRY_SPAN(size) ((off_t)sizeof(tar_header_t) + ((size) + 511) / 512 * 512)
+
+// Entries are identified by their position in archive order
+#define INDEX_NONE SIZE_MAX
+
+// Marks a hard link whose target is not in the archive
+#define INDEX_NO_TARGET UINT32_MAX
+
+// One path out of INDEX_RESTART is stored in full, the others only store what differs from the previous one
+#define INDEX_RESTART 16
+
+// Size of a buffer holding any path of the index, with its terminating null
+#define INDEX_PATH_MAX (sizeof(((tar_header_t *)0)->name) + 1)
+
+// Number of new entries whose paths are sorted together in memory by index_sort()
+#define INDEX_SORT_RUN 65536
+
+// New entries are inserted into the sorted path table by index_sort() rather than merged with it
+// while there is at most one of them per INDEX_INSERT_RATIO entries of the table
+#define INDEX_INSERT_RATIO 32
+
+// Extent cache of TAR_INDEX_CACHE, direct-mapped on the offset of the content
+#define INDEX_CACHE_SLOTS 64
+#define INDEX_CACHE_MAX_SIZE (64 * 1024)
+
+// Grows an array to hold count elements
+#define INDEX_GROW(array, count) index_grow((void **)&(array), (count) * sizeof(*(array)))
+
+// Capacity following the given one, grown by half and by INDEX_RESTART, so as to stay a multiple of INDEX_RESTART
+#define INDEX_NEXT_CAPACITY(capacity) (((capacity) + (capacity) / 2) / INDEX_RESTART * INDEX_RESTART + INDEX_RESTART)
+
+// Maximum load of the table of the entries by path, in percent, which grows by a quarter when it is reached
+#define INDEX_MAX_LOAD 80
+
+#define BIT_GET(bitmap, i) ((bitmap)[(i) / 8] & (1 << ((i) % 8)))
+#define BIT_SET(bitmap, i) ((bitmap)[(i) / 8] |= 1 << ((i) % 8))
+
+typedef struct
+{
+    uint32_t position; // Position of the entry + 1, zero meaning an empty slot
+    uint32_t hash;     // Hash of its path, compared before decoding the path
+} index_slot_t;
+
+typedef struct
+{
+    uint64_t header; // Offset of the header of the entry
+    uint64_t path;   // Offset of its path in paths, stored in full
+} index_restart_t;
+
+typedef struct
+{
+    uint32_t position;
+    // For a hard link, the position of the entry holding its content, resolved when it is indexed.
+    // For a symlink, the offset of its target in link_arena.
+    uint32_t link;
+} index_link_t;
+
+typedef struct
+{
+    off_t offset; // Offset of the cached content, zero if the slot is empty
+    size_t size;
+    uint8_t *data;
+} index_extent_t;
+
+struct tar_index
+{
+    int tar_fd;
+    int flags;
+    off_t end; // Offset of the end-of-archive marker, where parsing resumes
+
+    // The fields of the entries, in archive order, each in its own array.
+    // The arrays grow by half their capacity, and are trimmed to the entries once the archive is parsed.
+    size_t no_entries;
+    size_t capacity; // Always a multiple of INDEX_RESTART
+    uint64_t *sizes;
+    char *typeflags;
+    // Every INDEX_RESTART-th entry is a restart point, from which the header offsets of the next ones
+    // follow from their sizes and their paths are decoded.
+    index_restart_t *restarts;
+
+    // The links of the symlinks and hard links only, in archive order
+    index_link_t *links;
+    size_t no_linked;
+    size_t links_capacity;
+
+    // Bitmap of the entries whose header has been validated. With TAR_INDEX_LAZY, a header
+    // is validated the first time a lookup touches it, otherwise when it is parsed.
+    uint8_t *validated;
+    // Bitmap of the entries shadowed by a later entry with the same path
+    uint8_t *shadowed;
+
+    // Paths of the entries, front-coded in archive order: each path is stored as the length of the prefix
+    // it shares with the previous one, the length of the rest and the rest itself, without a terminating null.
+    uint8_t *paths;
+    size_t paths_len;
+    size_t paths_capacity;
+    char last_path[INDEX_PATH_MAX];
+
+    // Symlink targets, null-terminated and stored once each
+    char *link_arena;
+    size_t link_arena_len;
+    size_t link_arena_capacity;
+    uint32_t *link_slots; // Open-addressing table of offsets in link_arena + 1
+    size_t no_link_slots;
+    size_t no_links;
+
+    // Open-addressing table of the entries by path, kept at most INDEX_MAX_LOAD full.
+    // A path maps to its last entry in the archive, which shadows the earlier ones.
+    index_slot_t *slots;
+    size_t no_slots;
+
+    // Positions of the live entries sorted by path, so that the entries sharing a prefix are contiguous.
+    // The entries from sorted_upto onwards are merged in by the next prefix query.
+    uint32_t *sorted;
+    size_t no_sorted;
+    size_t sorted_upto;
+
+    // With TAR_INDEX_CACHE, the content of the small entries that were read.
+    // All the hard links to an entry share its extent.
+    index_extent_t *cache;
+};
+
+int index_grow(void **array, size_t size)
+{
+    void *grown = realloc(*array, size);
+    if (grown == NULL)
+        return -1;
+    *array = grown;
+    return 0;
+}
+
+// FNV-1a
+uint32_t index_hash(const char *path)
+{
+    uint32_t hash = 2166136261U;
+    for (; *path != '\0'; path++)
+    {
+        hash ^= (uint8_t)*path;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Decodes a path record over the previous path, held in a buffer of at least INDEX_PATH_MAX bytes.
+ *
+ * @return the next record.
+ */
+uint8_t *index_next_path(uint8_t *record, char *path)
+{
+    uint8_t shared = record[0];
+    uint8_t len = record[1];
+    memcpy(path + shared, record + 2, len);
+    path[shared + len] = '\0';
+    return record + 2 + len;
+}
+
+/**
+ * Decodes the path of an entry into a buffer of at least INDEX_PATH_MAX bytes.
+ */
+char *index_path(tar_index_t *index, size_t position, char *path)
+{
+    uint8_t *record = index->paths + index->restarts[position / INDEX_RESTART].path;
+    for (size_t i = 0; i <= position % INDEX_RESTART; i++)
+        record = index_next_path(record, path);
+    return path;
+}
+
+/**
+ * @return the offset of the header of an entry.
+ */
+off_t index_offset(tar_index_t *index, size_t position)
+{
+    size_t restart = position / INDEX_RESTART;
+    off_t offset = index->restarts[restart].header;
+    for (size_t i = restart * INDEX_RESTART; i < position; i++)
+        offset += ENTRY_SPAN((off_t)index->sizes[i]);
+    return offset;
+}
+
+/**
+ * @return the link of a symlink or a hard link, as stored in index_link_t.
+ */
+uint32_t index_link(tar_index_t *index, size_t position)
+{
+    size_t low = 0, high = index->no_linked;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (index->links[mid].position < position)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return index->links[low].link;
+}
+
+// Slot where the probe for a hash starts, mapping the hash onto any number of slots
+size_t index_slot_start(uint32_t hash, size_t no_slots)
+{
+    return (uint64_t)hash * no_slots >> 32;
+}
+
+/**
+ * Returns the slot holding the given path, or the empty slot where it would be inserted.
+ */
+index_slot_t *index_slot(tar_index_t *index, const char *path, uint32_t hash)
+{
+    char buf[INDEX_PATH_MAX];
+    for (size_t i = index_slot_start(hash, index->no_slots);; i = i + 1 < index->no_slots ? i + 1 : 0)
+    {
+        index_slot_t *slot = &index->slots[i];
+        if (slot->position == 0)
+            return slot;
+        if (slot->hash == hash && strcmp(index_path(index, slot->position - 1, buf), path) == 0)
+            return slot;
+    }
+}
+
+/**
+ * @return the position of the live entry at the given path, or INDEX_NONE.
+ */
+size_t index_find(tar_index_t *index, const char *path)
+{
+    index_slot_t *slot = index_slot(index, path, index_hash(path));
+    if (slot->position == 0)
+        return INDEX_NONE;
+    return slot->position - 1;
+}
+
+int index_rehash(tar_index_t *index, size_t no_slots)
+{
+    index_slot_t *slots = (index_slot_t *)calloc(no_slots, sizeof(index_slot_t));
+    if (slots == NULL)
+        return -1;
+
+    // The slots are placed by their stored hash, so no path needs to be decoded
+    for (size_t i = 0; i < index->no_slots; i++)
+    {
+        if (index->slots[i].position == 0)
+            continue;
+        size_t j = index_slot_start(index->slots[i].hash, no_slots);
+        while (slots[j].position != 0)
+            j = j + 1 < no_slots ? j + 1 : 0;
+        slots[j] = index->slots[i];
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->no_slots = no_slots;
+    return 0;
+}
+
+/**
+ * Stores a symlink target once in link_arena.
+ *
+ * @return the offset of the target in link_arena, or INDEX_NO_TARGET if it could not be allocated.
+ */
+uint32_t index_intern(tar_index_t *index, const char *link)
+{
+    if ((index->no_links + 1) * 2 > index->no_link_slots)
+    {
+        size_t no_link_slots = index->no_link_slots == 0 ? 16 : index->no_link_slots * 2;
+        uint32_t *link_slots = (uint32_t *)calloc(no_link_slots, sizeof(uint32_t));
+        if (link_slots == NULL)
+            return INDEX_NO_TARGET;
+        for (size_t i = 0; i < index->no_link_slots; i++)
+        {
+            if (index->link_slots[i] == 0)
+                continue;
+            size_t j = index_hash(index->link_arena + index->link_slots[i] - 1) & (no_link_slots - 1);
+            while (link_slots[j] != 0)
+                j = (j + 1) & (no_link_slots - 1);
+            link_slots[j] = index->link_slots[i];
+        }
+        free(index->link_slots);
+        index->link_slots = link_slots;
+        index->no_link_slots = no_link_slots;
+    }
+
+    size_t mask = index->no_link_slots - 1;
+    size_t i = index_hash(link) & mask;
+    for (; index->link_slots[i] != 0; i = (i + 1) & mask)
+    {
+        if (strcmp(index->link_arena + index->link_slots[i] - 1, link) == 0)
+            return index->link_slots[i] - 1;
+    }
+
+    size_t len = strlen(link) + 1;
+    if (index->link_arena_len + len > index->link_arena_capacity)
+    {
+        size_t capacity = index->link_arena_capacity == 0 ? 4096 : index->link_arena_capacity * 2;
+        if (INDEX_GROW(index->link_arena, capacity) == -1)
+            return INDEX_NO_TARGET;
+        index->link_arena_capacity = capacity;
+    }
+    uint32_t offset = index->link_arena_len;
+    memcpy(index->link_arena + offset, link, len);
+    index->link_arena_len += len;
+    index->link_slots[i] = offset + 1;
+    index->no_links++;
+    return offset;
+}
+
+/**
+ * Grows or trims the arrays of the fields of the entries to the given capacity, a multiple of INDEX_RESTART.
+ */
+int index_resize(tar_index_t *index, size_t capacity)
+{
+    int failed = INDEX_GROW(index->sizes, capacity) == -1 || INDEX_GROW(index->typeflags, capacity) == -1 ||
+                 INDEX_GROW(index->restarts, capacity / INDEX_RESTART) == -1 ||
+                 INDEX_GROW(index->validated, capacity / 8) == -1 || INDEX_GROW(index->shadowed, capacity / 8) == -1;
+
+    // Whether they failed or not, the arrays hold at least the smallest of both capacities
+    if (capacity > index->capacity)
+    {
+        if (failed)
+            return -1;
+        memset(index->validated + index->capacity / 8, 0, (capacity - index->capacity) / 8);
+        memset(index->shadowed + index->capacity / 8, 0, (capacity - index->capacity) / 8);
+    }
+    index->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Releases the capacity of the arrays of the index beyond its entries.
+ */
+void index_trim(tar_index_t *index)
+{
+    size_t capacity = (index->no_entries + INDEX_RESTART - 1) / INDEX_RESTART * INDEX_RESTART;
+    if (capacity > 0 && capacity < index->capacity)
+        index_resize(index, capacity);
+    if (index->paths_len > 0 && INDEX_GROW(index->paths, index->paths_len) == 0)
+        index->paths_capacity = index->paths_len;
+    if (index->no_linked > 0 && INDEX_GROW(index->links, index->no_linked) == 0)
+        index->links_capacity = index->no_linked;
+}
+
+int index_add(tar_index_t *index, tar_header_t *header, off_t offset, off_t size, int validated)
+{
+    size_t position = index->no_entries;
+    if (position == INDEX_NO_TARGET - 1)
+        return -1;
+
+    if (position == index->capacity && index_resize(index, INDEX_NEXT_CAPACITY(index->capacity)) == -1)
+        return -1;
+    if ((position + 1) * 100 > index->no_slots * INDEX_MAX_LOAD && index_rehash(index, index->no_slots + index->no_slots / 4) == -1)
+        return -1;
+    int linked = header->typeflag == SYMTYPE || header->typeflag == LNKTYPE;
+    if (linked && index->no_linked == index->links_capacity)
+    {
+        size_t capacity = INDEX_NEXT_CAPACITY(index->links_capacity);
+        if (INDEX_GROW(index->links, capacity) == -1)
+            return -1;
+        index->links_capacity = capacity;
+    }
+
+    char path[INDEX_PATH_MAX];
+    char link[INDEX_PATH_MAX];
+    size_t len = strnlen(header->name, sizeof(header->name));
+    memcpy(path, header->name, len);
+    path[len] = '\0';
+    size_t link_len = strnlen(header->linkname, sizeof(header->linkname));
+    memcpy(link, header->linkname, link_len);
+    link[link_len] = '\0';
+
+    size_t shared = 0;
+    if (position % INDEX_RESTART == 0)
+    {
+        index->restarts[position / INDEX_RESTART].header = offset;
+        index->restarts[position / INDEX_RESTART].path = index->paths_len;
+    }
+    else
+    {
+        while (shared < len && index->last_path[shared] == path[shared])
+            shared++;
+    }
+    if (index->paths_len + 2 + len - shared > index->paths_capacity)
+    {
+        size_t capacity = index->paths_capacity == 0 ? 4096 : index->paths_capacity + index->paths_capacity / 2;
+        if (capacity < index->paths_len + 2 + len - shared)
+            capacity = index->paths_len + 2 + len - shared;
+        if (INDEX_GROW(index->paths, capacity) == -1)
+            return -1;
+        index->paths_capacity = capacity;
+    }
+
+    index_link_t entry_link = {position, 0};
+    if (header->typeflag == SYMTYPE)
+    {
+        entry_link.link = index_intern(index, link);
+        if (entry_link.link == INDEX_NO_TARGET)
+            return -1;
+    }
+    else if (header->typeflag == LNKTYPE)
+    {
+        // The target of a hard link comes before it in the archive, and is never a hard link itself once resolved
+        size_t target = index_find(index, link);
+        if (target == INDEX_NONE)
+            entry_link.link = INDEX_NO_TARGET;
+        else if (index->typeflags[target] == LNKTYPE)
+            entry_link.link = index_link(index, target);
+        else
+            entry_link.link = target;
+    }
+    if (linked)
+        index->links[index->no_linked++] = entry_link;
+
+    index->paths[index->paths_len++] = shared;
+    index->paths[index->paths_len++] = len - shared;
+    memcpy(index->paths + index->paths_len, path + shared, len - shared);
+    index->paths_len += len - shared;
+    memcpy(index->last_path, path, len + 1);
+
+    index->sizes[position] = size;
+    index->typeflags[position] = header->typeflag;
+    if (validated)
+        BIT_SET(index->validated, position);
+    index->no_entries++;
+
+    uint32_t hash = index_hash(path);
+    index_slot_t *slot = index_slot(index, path, hash);
+    if (slot->position != 0)
+        BIT_SET(index->shadowed, slot->position - 1);
+    slot->position = position + 1;
+    slot->hash = hash;
+    return 0;
+}
+
+/**
+ * Parses the headers found from the end of the indexed part of the archive up to its current end-of-archive marker.
+ * With TAR_INDEX_LAZY, the headers are not validated, but their size is still checked against the archive.
+ *
+ * @param complete Whether the archive is expected to be complete, as when it is opened.
+ *                 Otherwise, parsing stops before an entry whose content or following block is not in the file yet,
+ *                 so that it is picked up by a later call.
+ *
+ * @return the number of entries added to the index,
+ *         the check_archive() error code of the first invalid header, -3 also if its size is negative
+ *         or runs past the end of a complete archive,
+ *         -4 if the archive could not be read or the index could not be allocated.
+ */
+int index_scan(tar_index_t *index, int complete)
+{
+    struct stat st;
+    if (fstat(index->tar_fd, &st) == -1)
+        return -4;
+
+    int lazy = index->flags & TAR_INDEX_LAZY;
+    int added = 0;
+    off_t offset = index->end;
+    while (offset + (off_t)sizeof(tar_header_t) <= st.st_size)
+    {
+        tar_header_t header;
+        if (pread(index->tar_fd, &header, sizeof(tar_header_t), offset) != sizeof(tar_header_t))
+            return -4;
+
+        // End-of-archive marker, which the next appended entry will overwrite
+        if (header.name[0] == '\0')
+            break;
+
+        if (!lazy)
+        {
+            int valid = validate_header(&header);
+            if (valid < 0)
+                return valid;
+        }
+
+        // The next offset is computed from the size even if the header is not validated, so it is bounded first
+        off_t size = header_size(&header);
+        if (size < 0 || (complete && size > st.st_size - offset - (off_t)sizeof(tar_header_t)))
+            return -3;
+        off_t next = offset + ENTRY_SPAN(size);
+        if (!complete && next + (off_t)sizeof(tar_header_t) > st.st_size)
+            break;
+
+        if (index_add(index, &header, offset, size, !lazy) == -1)
+            return -4;
+        added++;
+        offset = next;
+        index->end = next;
+    }
+    if (added > 0)
+        index_trim(index);
+    return added;
+}
+
+/**
+ * Validates the header of an entry, unless it already has been.
+ *
+ * @return 1 if the header is valid or the position is INDEX_NONE, the corresponding check_archive() error code,
+ *         or -4 if the header could not be read.
+ */
+int index_touch(tar_index_t *index, size_t position)
+{
+    if (position == INDEX_NONE || BIT_GET(index->validated, position))
+        return 1;
+
+    tar_header_t header;
+    if (pread(index->tar_fd, &header, sizeof(tar_header_t), index_offset(index, position)) != sizeof(tar_header_t))
+        return -4;
+
+    int valid = validate_header(&header);
+    if (valid > 0)
+        BIT_SET(index->validated, position);
+    return valid;
+}
+
+/**
+ * Resolves an entry to its linked-to entry if it is a symlink or a hard link, validating the headers along the way.
+ *
+ * @param valid Set to the index_touch() error code of the first header met that is invalid or could not be read,
+ *              1 otherwise.
+ *
+ * @return the position of the resolved entry,
+ *         or INDEX_NONE if a link is broken, too many links are followed or a header is invalid.
+ */
+size_t index_follow_links(tar_index_t *index, size_t position, int *valid)
+{
+    *valid = index_touch(index, position);
+    for (int i = 0; *valid > 0 && position != INDEX_NONE; i++)
+    {
+        char typeflag = index->typeflags[position];
+        if (typeflag != SYMTYPE && typeflag != LNKTYPE)
+            return position;
+        if (i == INDEX_MAX_LINKS)
+            return INDEX_NONE;
+
+        uint32_t link = index_link(index, position);
+        if (typeflag == LNKTYPE)
+            position = link != INDEX_NO_TARGET ? link : INDEX_NONE;
+        else
+        {
+            char *target = index->link_arena + link;
+            position = index_find(index, target);
+            if (position == INDEX_NONE)
+            {
+                // Directories are stored with a trailing slash
+                char link_with_slash[strlen(target) + 2];
+                strcpy(link_with_slash, target);
+                strcat(link_with_slash, "/");
+                position = index_find(index, link_with_slash);
+            }
+        }
+        *valid = index_touch(index, position);
+    }
+    return INDEX_NONE;
+}
+
+typedef struct
+{
+    uint32_t position;
+    char *path;
+} index_sort_t;
+
+// A sorted run of positions merged by index_sort(), with the decoded path of its next entry
+typedef struct
+{
+    uint32_t *next;
+    uint32_t *end;
+    char path[INDEX_PATH_MAX];
+} index_run_t;
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(((const index_sort_t *)a)->path, ((const index_sort_t *)b)->path);
+}
+
+int compare_positions(const void *a, const void *b)
+{
+    uint32_t pa = *(const uint32_t *)a;
+    uint32_t pb = *(const uint32_t *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Moves a run to its next live entry and decodes its path.
+ *
+ * @return 0 if the run is exhausted, 1 otherwise.
+ */
+int index_run_next(tar_index_t *index, index_run_t *run)
+{
+    while (run->next < run->end && BIT_GET(index->shadowed, *run->next))
+        run->next++;
+    if (run->next == run->end)
+        return 0;
+    index_path(index, *run->next, run->path);
+    return 1;
+}
+
+// Restores the order of a min-heap of runs after its i-th run has advanced
+void index_run_sift(index_run_t **heap, size_t no_heap, size_t i)
+{
+    while (1)
+    {
+        size_t min = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < no_heap && strcmp(heap[left]->path, heap[min]->path) < 0)
+            min = left;
+        if (right < no_heap && strcmp(heap[right]->path, heap[min]->path) < 0)
+            min = right;
+        if (min == i)
+            return;
+        index_run_t *run = heap[i];
+        heap[i] = heap[min];
+        heap[min] = run;
+        i = min;
+    }
+}
+
+/**
+ * Returns the position in the sorted path table of the first path that is not lower than the given prefix,
+ * or with upper set, of the first path that is greater than it and does not start with it.
+ * The paths starting with the prefix lie between the two.
+ */
+size_t index_bound(tar_index_t *index, const char *prefix, int upper)
+{
+    char path[INDEX_PATH_MAX];
+    size_t prefix_len = strlen(prefix);
+    size_t low = 0, high = index->no_sorted;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        index_path(index, index->sorted[mid], path);
+        int cmp = upper ? strncmp(path, prefix, prefix_len) : strcmp(path, prefix);
+        if (cmp < 0 || (upper && cmp == 0))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * Inserts the entries indexed since the last call into the sorted path table, for index_sort().
+ *
+ * Each new entry is placed by a binary search, so that only the paths on the way are decoded, and the table is
+ * moved once to make room for them. A new entry with the same path as an entry of the table shadows it and
+ * takes its place.
+ */
+int index_insert(tar_index_t *index)
+{
+    size_t no_new = index->no_entries - index->sorted_upto;
+    index_sort_t *added = (index_sort_t *)malloc(no_new * sizeof(index_sort_t));
+    char *added_paths = (char *)malloc(no_new * INDEX_PATH_MAX);
+    size_t *places = (size_t *)malloc(no_new * sizeof(size_t));
+    if (added == NULL || added_paths == NULL || places == NULL)
+    {
+        free(added);
+        free(added_paths);
+        free(places);
+        return -1;
+    }
+
+    char path[INDEX_PATH_MAX];
+    size_t first = index->sorted_upto;
+    uint8_t *record = index->paths + index->restarts[first / INDEX_RESTART].path;
+    for (size_t i = 0; i < first % INDEX_RESTART; i++)
+        record = index_next_path(record, path);
+    size_t no_added = 0;
+    for (size_t i = first; i < index->no_entries; i++)
+    {
+        record = index_next_path(record, path);
+        if (BIT_GET(index->shadowed, i))
+            continue;
+        added[no_added].position = i;
+        added[no_added].path = added_paths + no_added * INDEX_PATH_MAX;
+        strcpy(added[no_added].path, path);
+        no_added++;
+    }
+    qsort(added, no_added, sizeof(index_sort_t), compare_paths);
+
+    // The entries replacing a shadowed one are marked by a null path
+    size_t no_inserted = 0;
+    for (size_t i = 0; i < no_added; i++)
+    {
+        places[i] = index_bound(index, added[i].path, 0);
+        if (places[i] < index->no_sorted && strcmp(index_path(index, index->sorted[places[i]], path), added[i].path) == 0)
+        {
+            index->sorted[places[i]] = added[i].position;
+            added[i].path = NULL;
+        }
+        else
+            no_inserted++;
+    }
+
+    if (no_inserted > 0 && INDEX_GROW(index->sorted, index->no_sorted + no_inserted) == -1)
+    {
+        free(added);
+        free(added_paths);
+        free(places);
+        return -1;
+    }
+
+    // From the end, each part of the table after the place of a new entry is moved by the number of entries before it
+    size_t end = index->no_sorted;
+    size_t count = index->no_sorted + no_inserted;
+    for (size_t i = no_added; i-- > 0;)
+    {
+        if (added[i].path == NULL)
+            continue;
+        count -= end - places[i];
+        memmove(index->sorted + count, index->sorted + places[i], (end - places[i]) * sizeof(uint32_t));
+        index->sorted[--count] = added[i].position;
+        end = places[i];
+    }
+
+    free(added);
+    free(added_paths);
+    free(places);
+    index->no_sorted += no_inserted;
+    index->sorted_upto = index->no_entries;
+    return 0;
+}
+
+/**
+ * Merges the entries indexed since the last call into the sorted path table,
+ * dropping the entries they shadow.
+ *
+ * Few new entries are inserted by index_insert(). Otherwise, the new entries are decoded in archive order and sorted by runs of INDEX_SORT_RUN entries, keeping only
+ * their positions. The runs and the previous table are then merged, each path being decoded once more.
+ */
+int index_sort(tar_index_t *index)
+{
+    if (index->sorted_upto == index->no_entries)
+        return 0;
+
+    // A few entries appended to a large archive are inserted rather than merged, not to decode the whole table
+    size_t no_new = index->no_entries - index->sorted_upto;
+    if (no_new <= INDEX_SORT_RUN && no_new * INDEX_INSERT_RATIO <= index->no_sorted)
+        return index_insert(index);
+    size_t no_runs = (no_new + INDEX_SORT_RUN - 1) / INDEX_SORT_RUN + 1;
+    size_t run_len = no_new < INDEX_SORT_RUN ? no_new : INDEX_SORT_RUN;
+    uint32_t *added = (uint32_t *)malloc(no_new * sizeof(uint32_t));
+    uint32_t *sorted = (uint32_t *)malloc((index->no_sorted + no_new) * sizeof(uint32_t));
+    index_run_t *runs = (index_run_t *)malloc(no_runs * sizeof(index_run_t));
+    index_run_t **heap = (index_run_t **)malloc(no_runs * sizeof(index_run_t *));
+    index_sort_t *run = (index_sort_t *)malloc(run_len * sizeof(index_sort_t));
+    char *run_paths = (char *)malloc(run_len * INDEX_PATH_MAX);
+    if (added == NULL || sorted == NULL || runs == NULL || heap == NULL || run == NULL || run_paths == NULL)
+    {
+        free(added);
+        free(sorted);
+        free(runs);
+        free(heap);
+        free(run);
+        free(run_paths);
+        return -1;
+    }
+
+    // The previous table is the first run
+    runs[0].next = index->sorted;
+    runs[0].end = index->sorted + index->no_sorted;
+    no_runs = 1;
+
+    char path[INDEX_PATH_MAX];
+    size_t first = index->sorted_upto;
+    uint8_t *record = index->paths + index->restarts[first / INDEX_RESTART].path;
+    for (size_t i = 0; i < first % INDEX_RESTART; i++)
+        record = index_next_path(record, path);
+    size_t no_added = 0;
+    size_t no_run = 0;
+    for (size_t i = first; i <= index->no_entries; i++)
+    {
+        if (no_run == run_len || (i == index->no_entries && no_run > 0))
+        {
+            qsort(run, no_run, sizeof(index_sort_t), compare_paths);
+            runs[no_runs].next = added + no_added;
+            for (size_t j = 0; j < no_run; j++)
+                added[no_added++] = run[j].position;
+            runs[no_runs].end = added + no_added;
+            no_runs++;
+            no_run = 0;
+        }
+        if (i == index->no_entries)
+            break;
+
+        record = index_next_path(record, path);
+        if (BIT_GET(index->shadowed, i))
+            continue;
+        run[no_run].position = i;
+        run[no_run].path = run_paths + no_run * INDEX_PATH_MAX;
+        strcpy(run[no_run].path, path);
+        no_run++;
+    }
+    free(run);
+    free(run_paths);
+
+    size_t no_heap = 0;
+    for (size_t i = 0; i < no_runs; i++)
+    {
+        if (index_run_next(index, &runs[i]))
+            heap[no_heap++] = &runs[i];
+    }
+    for (size_t i = no_heap / 2; i-- > 0;)
+        index_run_sift(heap, no_heap, i);
+
+    size_t count = 0;
+    while (no_heap > 0)
+    {
+        sorted[count++] = *heap[0]->next++;
+        if (!index_run_next(index, heap[0]))
+            heap[0] = heap[--no_heap];
+        index_run_sift(heap, no_heap, 0);
+    }
+
+    free(added);
+    free(runs);
+    free(heap);
+    free(index->sorted);
+    index->sorted = sorted;
+    index->no_sorted = count;
+    index->sorted_upto = index->no_entries;
+    return 0;
+}
+
+
+/**
+ * Matches a path against a glob pattern.
+ *
+ * `?` matches any character but a slash, `*` matches any sequence of characters without a slash,
+ * and `**` matches any sequence of characters, `**` followed by a slash also matching no directory at all.
+ * The trailing slash marking a directory is not part of the path matched, and a pattern ending with a slash
+ * only matches directories.
+ */
+int glob_match(const char *pattern, const char *path)
+{
+    size_t len = strlen(path);
+    int dir = len > 0 && path[len - 1] == '/';
+    if (dir)
+        len--;
+    const char *end = pattern + strlen(pattern);
+    if (end > pattern && end[-1] == '/')
+    {
+        if (!dir)
+            return 0;
+        end--;
+    }
+
+    // Whether the part of the pattern read so far matches the path up to each position,
+    // updated for each element of the pattern so that the time is linear in the size of both
+    char reached[len + 1];
+    memset(reached, 0, len + 1);
+    reached[0] = 1;
+
+    while (pattern < end)
+    {
+        if (pattern[0] == '*' && pattern + 1 < end && pattern[1] == '*')
+        {
+            pattern += 2;
+            int slash = pattern < end && *pattern == '/';
+            if (slash)
+                pattern++;
+
+            // `**` reaches any later position, and `**/` any later position right after a slash
+            int seen = 0;
+            for (size_t j = 0; j <= len; j++)
+            {
+                int was = reached[j];
+                if (seen && (!slash || path[j - 1] == '/'))
+                    reached[j] = 1;
+                seen |= was;
+            }
+            continue;
+        }
+
+        if (*pattern == '*')
+        {
+            for (size_t j = 1; j <= len; j++)
+            {
+                if (reached[j - 1] && path[j - 1] != '/')
+                    reached[j] = 1;
+            }
+            pattern++;
+            continue;
+        }
+
+        int any = 0;
+        for (size_t j = len; j > 0; j--)
+        {
+            reached[j] = reached[j - 1] && (*pattern == '?' ? path[j - 1] != '/' : *pattern == path[j - 1]);
+            any |= reached[j];
+        }
+        reached[0] = 0;
+        if (!any)
+            return 0;
+        pattern++;
+    }
+    return reached[len];
+}
+
+/**
+ * Lists the live entries whose path starts with the given prefix and, if a pattern is given, matches it.
+ * See tar_glob() for the arguments and the return value.
+ */
+int index_query(tar_index_t *index, const char *prefix, const char *pattern, int flags, char **entries, size_t *no_entries)
+{
+    if (index_sort(index) == -1)
+    {
+        *no_entries = 0;
+        return -4;
+    }
+
+    char path[INDEX_PATH_MAX];
+    size_t first = index_bound(index, prefix, 0);
+    size_t last = index_bound(index, prefix, 1);
+
+    uint32_t *matches = (uint32_t *)malloc((last - first + 1) * sizeof(uint32_t));
+    if (matches == NULL)
+    {
+        *no_entries = 0;
+        return -4;
+    }
+
+    size_t no_matches = 0;
+    for (size_t i = first; i < last; i++)
+    {
+        // In lexical order, the matches past the size of `entries` are not needed
+        if (!(flags & TAR_ARCHIVE_ORDER) && no_matches == *no_entries)
+            break;
+        if (pattern == NULL || glob_match(pattern, index_path(index, index->sorted[i], path)))
+            matches[no_matches++] = index->sorted[i];
+    }
+    if (flags & TAR_ARCHIVE_ORDER)
+        qsort(matches, no_matches, sizeof(uint32_t), compare_positions);
+
+    size_t count = 0;
+    int valid = 1;
+    for (; count < no_matches && count < *no_entries; count++)
+    {
+        valid = index_touch(index, matches[count]);
+        if (valid < 0)
+            break;
+        index_path(index, matches[count], entries[count]);
+    }
+
+    free(matches);
+    *no_entries = count;
+    return valid < 0 ? valid : (int)count;
+}
+
+/**
+ * Reads part of the content of an entry, through the extent cache with TAR_INDEX_CACHE.
+ *
+ * @return the number of bytes read, or -1 on error.
+ */
+ssize_t index_pread(tar_index_t *index, size_t position, uint8_t *dest, size_t len, size_t offset)
+{
+    off_t content = index_offset(index, position) + sizeof(tar_header_t);
+    size_t size = index->sizes[position];
+    if (index->cache == NULL || size > INDEX_CACHE_MAX_SIZE)
+        return pread(index->tar_fd, dest, len, content + offset);
+
+    index_extent_t *extent = &index->cache[(content / 512) % INDEX_CACHE_SLOTS];
+    if (extent->offset != content)
+    {
+        uint8_t *data = (uint8_t *)realloc(extent->data, size);
+        if (data == NULL)
+            return pread(index->tar_fd, dest, len, content + offset);
+        extent->data = data;
+        extent->offset = 0;
+
+        ssize_t n = pread(index->tar_fd, extent->data, size, content);
+        if (n < 0)
+            return -1;
+        extent->offset = content;
+        extent->size = n;
+    }
+
+    if (offset >= extent->size)
+        return 0;
+    if (len > extent->size - offset)
+        len = extent->size - offset;
+    memcpy(dest, extent->data + offset, len);
+    return len;
+}
+
+/**
+ * Hot-swappable archive
+ */
+
+typedef struct
+{
+    int tar_fd;
+    tar_index_t *index;
+} swap_version_t;
+
+// Readers announce themselves in the counter of the parity of the epoch they entered in.
+// A reload publishes the new version, moves to the next epoch, then waits for the counter of
+// the previous epoch to drain: the readers that may still hold the old version are all counted there.
+struct tar_swap
+{
+    _Atomic(swap_version_t *) current;
+    atomic_ulong epoch;
+    atomic_long readers[2];
+    atomic_flag reloading; // Serializes the reloads, never taken by the readers
+};
+
+/**
+ * Opens an archive and builds a read-only index of it, which concurrent readers can share.
+ * The headers are all validated and the sorted path table is built up front, so that the lookups never modify the index.
+ */
+swap_version_t *swap_load(const char *path)
+{
+    swap_version_t *version = (swap_version_t *)malloc(sizeof(swap_version_t));
+    if (version == NULL)
+        return NULL;
+
+    version->tar_fd = open(path, O_RDONLY);
+    version->index = version->tar_fd == -1 ? NULL : tar_index_open(version->tar_fd, 0);
+    if (version->index == NULL || index_sort(version->index) == -1)
+    {
+        tar_index_close(version->index);
+        if (version->tar_fd != -1)
+            close(version->tar_fd);
+        free(version);
+        return NULL;
+    }
+    return version;
+}
+
+void swap_unload(swap_version_t *version)
+{
+    tar_index_close(version->index);
+    close(version->tar_fd);
+    free(version);
+}
+
 #endif // __LIB_TAR_INTERNAL_H__
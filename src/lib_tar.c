@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
@@ -42,6 +44,136 @@ int check_archive(int tar_fd)
     return count;
 }
 
+/**
+ * Checks whether the archive at the given path is valid, as check_archive() does, without filling the page cache.
+ *
+ * The archive is opened with O_DIRECT and read in large aligned buffers, one being read while the previous one is
+ * checked, so that a full scan runs at the bandwidth of the device without evicting the pages other processes use.
+ * On file systems which do not support O_DIRECT, the pages read are dropped from the page cache instead.
+ *
+ * @param path The path of a file supposed to contain a tar archive.
+ *
+ * @return the same values as check_archive(), -3 also if the size of an entry is negative or runs past the end
+ *         of the archive,
+ *         -4 if the archive could not be opened or read.
+ */
+int check_archive_direct(const char *path)
+{
+    scan_t scan;
+    scan.direct = 1;
+    scan.tar_fd = open(path, O_RDONLY | O_DIRECT);
+    if (scan.tar_fd == -1 && errno == EINVAL)
+    {
+        scan.direct = 0;
+        scan.tar_fd = open(path, O_RDONLY);
+    }
+    if (scan.tar_fd == -1)
+        return -4;
+    struct stat st;
+    if (fstat(scan.tar_fd, &st) == -1)
+    {
+        close(scan.tar_fd);
+        return -4;
+    }
+    if (!scan.direct)
+        posix_fadvise(scan.tar_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (posix_memalign((void **)&scan.buffers[0], SCAN_ALIGNMENT, SCAN_BUFFER_SIZE) != 0)
+    {
+        close(scan.tar_fd);
+        return -4;
+    }
+    if (posix_memalign((void **)&scan.buffers[1], SCAN_ALIGNMENT, SCAN_BUFFER_SIZE) != 0)
+    {
+        free(scan.buffers[0]);
+        close(scan.tar_fd);
+        return -4;
+    }
+    atomic_init(&scan.stop, 0);
+    int initialized = 0; // Pairs of semaphores initialized
+    while (initialized < 2 && sem_init(&scan.filled[initialized], 0, 0) == 0)
+    {
+        if (sem_init(&scan.empty[initialized], 0, 1) == -1)
+        {
+            sem_destroy(&scan.filled[initialized]);
+            break;
+        }
+        initialized++;
+    }
+
+    pthread_t reader;
+    int count = -4;
+    if (initialized == 2 && pthread_create(&reader, NULL, scan_read, &scan) == 0)
+    {
+        count = 0;
+        off_t offset = 0; // Offset of the buffer being checked
+        size_t skip = 0;  // Blocks of content left to skip
+        int zero_blocks = 0;
+        int done = 0;
+        for (int i = 0; !done; i ^= 1)
+        {
+            while (sem_wait(&scan.filled[i]) == -1 && errno == EINTR)
+                ;
+            ssize_t n = scan.lengths[i];
+            if (n < 0)
+                count = -4;
+            if (n < SCAN_BUFFER_SIZE)
+                done = 1;
+
+            for (ssize_t block = 0; count >= 0 && block < n / 512 && zero_blocks < 2; block++)
+            {
+                if (skip > 0)
+                {
+                    skip--;
+                    continue;
+                }
+
+                tar_header_t *header = (tar_header_t *)(scan.buffers[i] + block * 512);
+                if (header->name[0] == '\0')
+                {
+                    zero_blocks++;
+                    continue;
+                }
+                zero_blocks = 0;
+
+                int valid = validate_header(header);
+                off_t size = header_size(header);
+                if (valid < 0)
+                    count = valid;
+                else if (size < 0 || size > st.st_size - offset - (block + 1) * 512)
+                    count = -3;
+                else
+                {
+                    count++;
+                    skip = (size + 511) / 512;
+                }
+            }
+            if (count < 0 || zero_blocks == 2)
+                done = 1;
+            offset += n;
+            sem_post(&scan.empty[i]);
+        }
+
+        // Wake the reader up if it is waiting for a buffer
+        atomic_store(&scan.stop, 1);
+        sem_post(&scan.empty[0]);
+        sem_post(&scan.empty[1]);
+        pthread_join(reader, NULL);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (i < initialized)
+        {
+            sem_destroy(&scan.filled[i]);
+            sem_destroy(&scan.empty[i]);
+        }
+        free(scan.buffers[i]);
+    }
+    close(scan.tar_fd);
+    return count;
+}
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -90,16 +222,26 @@ int is_dir(int tar_fd, char *path)
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file nor a hard link to a file,
  *         any other value otherwise.
  */
 int is_file(int tar_fd, char *path)
 {
     tar_header_t *header = get_header(tar_fd, path);
+    // A hard link is a file if the entry it links to exists and is one
+    for (int i = 0; header != NULL && header->typeflag == LNKTYPE && i < INDEX_MAX_LINKS; i++)
+    {
+        char link[sizeof(header->linkname) + 1];
+        memcpy(link, header->linkname, sizeof(header->linkname));
+        link[sizeof(header->linkname)] = '\0';
+        free_header(header);
+        lseek(tar_fd, 0, SEEK_SET);
+        header = get_header(tar_fd, link);
+    }
     lseek(tar_fd, 0, SEEK_SET);
-    if (header == NULL)
-        return 0;
-    return header->typeflag == REGTYPE;
+    int file = header != NULL && (header->typeflag == REGTYPE || header->typeflag == AREGTYPE);
+    free_header(header);
+    return file;
 }
 
 /**
@@ -148,7 +290,8 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries)
     if (header != NULL && header->typeflag == SYMTYPE)
     {
         header = follow_symlinks(tar_fd, header);
-        path = header->name;
+        if (header != NULL)
+            path = header->name;
     }
 
     if (header == NULL || header->typeflag != DIRTYPE)
@@ -201,7 +344,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries)
  * Reads a file at a given path in the archive.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink or a hard link, it must be resolved to its linked-to entry.
  * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
  * @param dest A destination buffer to read the given file into.
  * @param len An in-out argument.
@@ -217,40 +360,520 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries)
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
 {
-    tar_header_t *header = get_header(tar_fd, path);
-    if (header == NULL || header->typeflag == DIRTYPE)
-    {
-        lseek(tar_fd, 0, SEEK_SET);
+    size_t size;
+    off_t content = find_file_content(tar_fd, path, &size);
+    if (content == -1)
+        return -1;
+    if (offset >= size)
+        return -2;
+
+    ssize_t remaining = clamp_read(size, offset, len);
+    pread(tar_fd, dest, *len, content + offset);
+    return remaining;
+}
+
+/**
+ * Reads a file at a given path in the archive into several buffers with a single system call.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink or a hard link, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param iov An array of buffers, filled in order as by preadv().
+ * @param iovcnt The number of buffers in iov.
+ * @param len An out argument.
+ *            The callee set it to the number of bytes written to the buffers.
+ *
+ * @return the same values as read_file(), the destination being the concatenation of the buffers,
+ *         -1 also if iovcnt is negative or greater than IOV_MAX.
+ */
+ssize_t read_file_v(int tar_fd, char *path, size_t offset, const struct iovec *iov, int iovcnt, size_t *len)
+{
+    size_t size;
+    off_t content = find_file_content(tar_fd, path, &size);
+    *len = 0;
+    if (content == -1)
         return -1;
+    return read_content_v(tar_fd, content, size, offset, iov, iovcnt, len);
+}
+
+/**
+ * Copies a file at a given path in the archive to another file descriptor, at its current offset.
+ *
+ * The content is moved by the kernel, with splice(), copy_file_range() or sendfile() depending on the
+ * type of out_fd, and is only copied into user space if the kernel does not support it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink or a hard link, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param out_fd A file descriptor to write the file to, e.g. a pipe, a socket or a regular file.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes to copy.
+ *            The callee set it to the number of bytes copied.
+ *
+ * @return the same values as read_file(),
+ *         -1 also if nothing could be written to out_fd, errno being set accordingly.
+ */
+ssize_t read_file_to_fd(int tar_fd, char *path, size_t offset, int out_fd, size_t *len)
+{
+    size_t size;
+    off_t content = find_file_content(tar_fd, path, &size);
+    if (content == -1)
+        return -1;
+    return read_content_to_fd(tar_fd, content, size, offset, out_fd, len);
+}
+
+/**
+ * Builds an index of the entries of an archive.
+ *
+ * By default, every header is validated as in check_archive() while the index is built.
+ * With TAR_INDEX_LAZY, a header is only validated the first time a lookup reaches it, and the result is remembered.
+ * The lookups then return -1, -2 or -3 as in check_archive() when they reach an invalid header.
+ * The size of every header is still checked while the index is built, as the next header is found from it.
+ *
+ * Hard links are resolved to the content of their target while the index is built.
+ * With TAR_INDEX_CACHE, the content of the small entries that are read is kept in memory,
+ * and reading any of the hard links to an entry hits the same cached content.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file. It must stay open until the handle is closed.
+ * @param flags Zero or more of TAR_INDEX_LAZY and TAR_INDEX_CACHE, combined with a bitwise or.
+ *
+ * @return a handle on the archive,
+ *         NULL if the archive contains an invalid header, could not be read or the index could not be allocated.
+ */
+tar_index_t *tar_index_open(int tar_fd, int flags)
+{
+    tar_index_t *index = (tar_index_t *)calloc(1, sizeof(tar_index_t));
+    if (index == NULL)
+        return NULL;
+
+    index->tar_fd = tar_fd;
+    index->flags = flags;
+    index->no_slots = 16;
+    index->slots = (index_slot_t *)calloc(index->no_slots, sizeof(index_slot_t));
+    if (flags & TAR_INDEX_CACHE)
+        index->cache = (index_extent_t *)calloc(INDEX_CACHE_SLOTS, sizeof(index_extent_t));
+    if (index->slots == NULL || ((flags & TAR_INDEX_CACHE) && index->cache == NULL) || index_scan(index, 1) < 0)
+    {
+        tar_index_close(index);
+        return NULL;
     }
+    return index;
+}
+
+/**
+ * Indexes the entries appended to the archive since the handle was opened or last refreshed.
+ *
+ * Only the part of the archive after the previously recorded end-of-archive marker is parsed,
+ * so the cost of a refresh is proportional to the number of appended bytes.
+ * An entry is only indexed once the file extends past its content by at least one block, where its end-of-archive
+ * marker goes, and is otherwise left for a later refresh. In an archive padded past its end-of-archive marker,
+ * this already holds when the header alone is written, so a writer appending to such an archive while it is
+ * refreshed must write the content of an entry before its header.
+ *
+ * @param index A handle returned by tar_index_open().
+ *
+ * @return a zero or positive value representing the number of entries added to the index,
+ *         -1, -2 or -3 if an appended header is invalid, as in check_archive(), -3 also if its size is negative,
+ *         -4 if the archive could not be read or the index could not be allocated.
+ */
+int tar_index_refresh(tar_index_t *index)
+{
+    // Appended entries overwrite the end-of-archive marker, possibly without growing the file
+    // when the archive was padded, so the marker itself is checked rather than the file size.
+    return index_scan(index, 0);
+}
 
-    if (header->typeflag == SYMTYPE)
+/**
+ * Releases a handle. The underlying file descriptor is left open.
+ *
+ * @param index A handle returned by tar_index_open(), or NULL.
+ */
+void tar_index_close(tar_index_t *index)
+{
+    if (index == NULL)
+        return;
+    free(index->sizes);
+    free(index->typeflags);
+    free(index->links);
+    free(index->validated);
+    free(index->shadowed);
+    free(index->paths);
+    free(index->restarts);
+    free(index->link_arena);
+    free(index->link_slots);
+    free(index->sorted);
+    if (index->cache != NULL)
     {
-        header = follow_symlinks(tar_fd, header);
+        for (size_t i = 0; i < INDEX_CACHE_SLOTS; i++)
+            free(index->cache[i].data);
+        free(index->cache);
     }
-    if (header == NULL || header->typeflag == DIRTYPE)
+    free(index->slots);
+    free(index);
+}
+
+/**
+ * Same as exists(), on an indexed archive.
+ */
+int tar_index_exists(tar_index_t *index, char *path)
+{
+    size_t position = index_find(index, path);
+    int valid = index_touch(index, position);
+    if (valid < 0)
+        return valid;
+    return position != INDEX_NONE;
+}
+
+/**
+ * Same as is_dir(), on an indexed archive.
+ */
+int tar_index_is_dir(tar_index_t *index, char *path)
+{
+    size_t position = index_find(index, path);
+    int valid = index_touch(index, position);
+    if (valid < 0)
+        return valid;
+    if (position == INDEX_NONE)
+        return 0;
+    return index->typeflags[position] == DIRTYPE;
+}
+
+/**
+ * Same as is_file(), on an indexed archive.
+ */
+int tar_index_is_file(tar_index_t *index, char *path)
+{
+    size_t position = index_find(index, path);
+    int valid = index_touch(index, position);
+    if (valid < 0)
+        return valid;
+    if (position != INDEX_NONE && index->typeflags[position] == LNKTYPE)
     {
-        lseek(tar_fd, 0, SEEK_SET);
-        return -1;
+        // A hard link is a file if the entry it links to exists and is one
+        uint32_t link = index_link(index, position);
+        position = link != INDEX_NO_TARGET ? link : INDEX_NONE;
+        valid = index_touch(index, position);
+        if (valid < 0)
+            return valid;
     }
+    if (position == INDEX_NONE)
+        return 0;
+    return index->typeflags[position] == REGTYPE || index->typeflags[position] == AREGTYPE;
+}
 
-    size_t size = TAR_INT(header->size);
-    if (offset >= size)
+/**
+ * Same as is_symlink(), on an indexed archive.
+ */
+int tar_index_is_symlink(tar_index_t *index, char *path)
+{
+    size_t position = index_find(index, path);
+    int valid = index_touch(index, position);
+    if (valid < 0)
+        return valid;
+    if (position == INDEX_NONE)
+        return 0;
+    return index->typeflags[position] == SYMTYPE;
+}
+
+/**
+ * Same as list(), on an indexed archive.
+ * Returns -4 if the sorted path table could not be allocated.
+ */
+int tar_index_list(tar_index_t *index, char *path, char **entries, size_t *no_entries)
+{
+    int valid;
+    size_t dir = index_follow_links(index, index_find(index, path), &valid);
+    if (dir == INDEX_NONE || index->typeflags[dir] != DIRTYPE)
     {
-        lseek(tar_fd, 0, SEEK_SET);
-        return -2;
+        *no_entries = 0;
+        return valid < 0 ? valid : 0;
     }
-    lseek(tar_fd, offset, SEEK_CUR);
 
-    ssize_t read_size = size - offset;
-    ssize_t remaining = read_size - *len;
-    if (remaining < 0)
+    if (index_sort(index) == -1)
     {
-        *len = read_size;
-        remaining = 0;
+        *no_entries = 0;
+        return -4;
     }
 
-    read(tar_fd, dest, *len);
-    lseek(tar_fd, 0, SEEK_SET);
+    char dir_path[INDEX_PATH_MAX];
+    char entry_path[INDEX_PATH_MAX];
+    path = index_path(index, dir, dir_path);
+    size_t path_len = strlen(path);
+    size_t count = 0;
+
+    // The directory comes first among the paths it prefixes
+    for (size_t i = index_bound(index, path, 0) + 1; i < index->no_sorted && count < *no_entries; i++)
+    {
+        char *entry = index_path(index, index->sorted[i], entry_path);
+        if (strncmp(entry, path, path_len) != 0)
+            break;
+
+        // Skip entries in subdirectories
+        char *slash = strchr(entry + path_len, '/');
+        if (slash != NULL && slash[1] != '\0')
+            continue;
+
+        valid = index_touch(index, index->sorted[i]);
+        if (valid < 0)
+        {
+            *no_entries = count;
+            return valid;
+        }
+
+        strcpy(entries[count], entry);
+        count++;
+    }
+
+    *no_entries = count;
+    return count;
+}
+
+/**
+ * Same as read_file(), on an indexed archive.
+ */
+ssize_t tar_index_read_file(tar_index_t *index, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    int valid;
+    size_t position = index_follow_links(index, index_find(index, path), &valid);
+    if (valid < 0)
+        return valid;
+    if (position == INDEX_NONE || index->typeflags[position] == DIRTYPE)
+        return -1;
+
+    size_t size = index->sizes[position];
+    if (offset >= size)
+        return -2;
+
+    ssize_t remaining = clamp_read(size, offset, len);
+    ssize_t n = index_pread(index, position, dest, *len, offset);
+    if (n < 0)
+        return -1;
+    *len = n;
     return remaining;
 }
+
+/**
+ * Same as read_file_v(), on an indexed archive.
+ */
+ssize_t tar_index_read_file_v(tar_index_t *index, char *path, size_t offset, const struct iovec *iov, int iovcnt, size_t *len)
+{
+    *len = 0;
+    int valid;
+    size_t position = index_follow_links(index, index_find(index, path), &valid);
+    if (valid < 0)
+        return valid;
+    if (position == INDEX_NONE || index->typeflags[position] == DIRTYPE)
+        return -1;
+
+    off_t content = index_offset(index, position) + sizeof(tar_header_t);
+    return read_content_v(index->tar_fd, content, index->sizes[position], offset, iov, iovcnt, len);
+}
+
+/**
+ * Same as read_file_to_fd(), on an indexed archive.
+ */
+ssize_t tar_index_read_file_to_fd(tar_index_t *index, char *path, size_t offset, int out_fd, size_t *len)
+{
+    int valid;
+    size_t position = index_follow_links(index, index_find(index, path), &valid);
+    if (valid < 0)
+        return valid;
+    if (position == INDEX_NONE || index->typeflags[position] == DIRTYPE)
+        return -1;
+
+    off_t content = index_offset(index, position) + sizeof(tar_header_t);
+    return read_content_to_fd(index->tar_fd, content, index->sizes[position], offset, out_fd, len);
+}
+
+/**
+ * Lists the entries whose path starts with the given prefix, recursively.
+ *
+ * Only the part of the sorted path table of the index holding the prefix is visited.
+ *
+ * @param index A handle returned by tar_index_open().
+ * @param prefix A path prefix, e.g. "dir1/" or "dir1/file".
+ * @param flags Zero to list the entries in lexical order, TAR_ARCHIVE_ORDER to list them in archive order.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return the number of entries listed,
+ *         -1, -2 or -3 if a listed entry has an invalid header (see TAR_INDEX_LAZY),
+ *         -4 if the sorted path table could not be allocated.
+ */
+int tar_find_prefix(tar_index_t *index, char *prefix, int flags, char **entries, size_t *no_entries)
+{
+    return index_query(index, prefix, NULL, flags, entries, no_entries);
+}
+
+/**
+ * Lists the entries whose path matches a glob pattern.
+ *
+ * `?` matches any character but a slash, `*` matches any sequence of characters without a slash,
+ * and `**` matches any sequence of characters, slashes included; when followed by a slash, it may also match no directory.
+ * The trailing slash of a directory is not matched, so a pattern ending with a slash and a star lists the content
+ * of a directory but not the directory itself.
+ * A pattern ending with a slash only matches directories.
+ * Only the part of the sorted path table holding the literal prefix of the pattern, before its first wildcard, is visited.
+ *
+ * @param index A handle returned by tar_index_open().
+ * @param pattern A glob pattern.
+ * @param flags Zero to list the entries in lexical order, TAR_ARCHIVE_ORDER to list them in archive order.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return the number of entries listed,
+ *         -1, -2 or -3 if a listed entry has an invalid header (see TAR_INDEX_LAZY),
+ *         -4 if the sorted path table could not be allocated.
+ */
+int tar_glob(tar_index_t *index, char *pattern, int flags, char **entries, size_t *no_entries)
+{
+    size_t prefix_len = strcspn(pattern, "*?");
+    char prefix[prefix_len + 1];
+    memcpy(prefix, pattern, prefix_len);
+    prefix[prefix_len] = '\0';
+    return index_query(index, prefix, pattern, flags, entries, no_entries);
+}
+
+/**
+ * Opens an archive that can be replaced by a new one while it is being read.
+ *
+ * The archive and its index form a version. Readers access the current version without taking any lock,
+ * and a reload publishes a new version atomically: the reads in progress finish on the version they started on,
+ * which is released once no reader holds it anymore.
+ *
+ * @param path The path of a tar archive file.
+ *
+ * @return a handle on the archive,
+ *         NULL if the archive could not be opened, contains an invalid header or could not be indexed.
+ */
+tar_swap_t *tar_swap_open(const char *path)
+{
+    tar_swap_t *swap = (tar_swap_t *)malloc(sizeof(tar_swap_t));
+    if (swap == NULL)
+        return NULL;
+
+    swap_version_t *version = swap_load(path);
+    if (version == NULL)
+    {
+        free(swap);
+        return NULL;
+    }
+    atomic_init(&swap->current, version);
+    atomic_init(&swap->epoch, 0);
+    atomic_init(&swap->readers[0], 0);
+    atomic_init(&swap->readers[1], 0);
+    atomic_flag_clear(&swap->reloading);
+    return swap;
+}
+
+/**
+ * Replaces the archive of a handle by the archive currently at the given path.
+ *
+ * The new archive is opened and indexed by the calling thread, typically a background one, before being published.
+ * The call then waits until the readers that may hold the previous version are done, and releases it.
+ * Readers are never blocked by a reload. Concurrent reloads are serialized.
+ *
+ * @param swap A handle returned by tar_swap_open().
+ * @param path The path of a tar archive file, e.g. the path the previous archive was replaced at.
+ *
+ * @return zero if the new archive was published,
+ *         -1 if it could not be opened, contains an invalid header or could not be indexed, the previous one staying current.
+ */
+int tar_swap_reload(tar_swap_t *swap, const char *path)
+{
+    swap_version_t *version = swap_load(path);
+    if (version == NULL)
+        return -1;
+
+    while (atomic_flag_test_and_set(&swap->reloading))
+        sched_yield();
+
+    swap_version_t *old = atomic_exchange(&swap->current, version);
+    unsigned long epoch = atomic_fetch_add(&swap->epoch, 1);
+    while (atomic_load(&swap->readers[epoch & 1]) != 0)
+        sched_yield();
+
+    atomic_flag_clear(&swap->reloading);
+    swap_unload(old);
+    return 0;
+}
+
+/**
+ * Releases a handle and its current version. No reader may use it anymore.
+ *
+ * @param swap A handle returned by tar_swap_open(), or NULL.
+ */
+void tar_swap_close(tar_swap_t *swap)
+{
+    if (swap == NULL)
+        return;
+    swap_unload(atomic_load(&swap->current));
+    free(swap);
+}
+
+/**
+ * Starts reading the current version of an archive, which stays valid until tar_swap_release() is called.
+ *
+ * The returned index is shared between readers and must only be passed to the tar_index_* lookups,
+ * not to tar_index_refresh() or tar_index_close().
+ *
+ * @param swap A handle returned by tar_swap_open().
+ * @param epoch An out argument, to pass to tar_swap_release().
+ *
+ * @return the index of the current version.
+ */
+tar_index_t *tar_swap_acquire(tar_swap_t *swap, int *epoch)
+{
+    while (1)
+    {
+        unsigned long current = atomic_load(&swap->epoch);
+        atomic_fetch_add(&swap->readers[current & 1], 1);
+
+        // Otherwise, a reload may have started waiting on the other counter, so announce again
+        if (atomic_load(&swap->epoch) == current)
+        {
+            *epoch = current & 1;
+            return atomic_load(&swap->current)->index;
+        }
+        atomic_fetch_sub(&swap->readers[current & 1], 1);
+    }
+}
+
+/**
+ * Ends a read started with tar_swap_acquire().
+ *
+ * @param swap A handle returned by tar_swap_open().
+ * @param epoch The value set by tar_swap_acquire().
+ */
+void tar_swap_release(tar_swap_t *swap, int epoch)
+{
+    atomic_fetch_sub(&swap->readers[epoch], 1);
+}
+
+/**
+ * Same as read_file(), on the current version of an archive.
+ */
+ssize_t tar_swap_read_file(tar_swap_t *swap, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    int epoch;
+    tar_index_t *index = tar_swap_acquire(swap, &epoch);
+    ssize_t ret = tar_index_read_file(index, path, offset, dest, len);
+    tar_swap_release(swap, epoch);
+    return ret;
+}
+
+/**
+ * Same as list(), on the current version of an archive.
+ */
+int tar_swap_list(tar_swap_t *swap, char *path, char **entries, size_t *no_entries)
+{
+    int epoch;
+    tar_index_t *index = tar_swap_acquire(swap, &epoch);
+    int ret = tar_index_list(index, path, entries, no_entries);
+    tar_swap_release(swap, epoch);
+    return ret;
+}
@@ -1,11 +1,17 @@
 #ifndef __HELPERS_H__
 #define __HELPERS_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <criterion/criterion.h>
 #include <criterion/assert.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "lib_tar.h"
 
@@ -104,4 +110,110 @@ void test_list(int fd, char *path, int expected, char *expected_entries[])
 	}
 }
 
+/**
+ * Copies an archive into an anonymous temporary file, so that tests can modify it.
+ */
+int copy_archive(int fd)
+{
+	char filename[] = "/tmp/lib_tar_XXXXXX";
+	int copy_fd = mkstemp(filename);
+	cr_assert_neq(copy_fd, -1, "mkstemp() failed");
+	unlink(filename);
+
+	char buf[4096];
+	ssize_t n;
+	off_t offset = 0;
+	while ((n = pread(fd, buf, sizeof(buf), offset)) > 0)
+	{
+		cr_assert_eq(pwrite(copy_fd, buf, n, offset), n, "pwrite() failed");
+		offset += n;
+	}
+	return copy_fd;
+}
+
+/**
+ * Returns the offset of the header of the first entry at the given path in an archive,
+ * or the offset of its end-of-archive marker if path is NULL or no such entry exists.
+ */
+off_t header_offset(int fd, char *path)
+{
+	tar_header_t header;
+	off_t offset = 0;
+	while (pread(fd, &header, sizeof(header), offset) == sizeof(header) && header.name[0] != '\0')
+	{
+		if (path != NULL && strcmp(header.name, path) == 0)
+			break;
+		offset += sizeof(header) + (TAR_INT(header.size) + 511) / 512 * 512;
+	}
+	return offset;
+}
+
+/**
+ * Computes the checksum of a header into its chksum field.
+ */
+void write_chksum(tar_header_t *header)
+{
+	memset(header->chksum, ' ', sizeof(header->chksum));
+	unsigned int chksum = 0;
+	for (size_t i = 0; i < sizeof(*header); i++)
+		chksum += ((uint8_t *)header)[i];
+	snprintf(header->chksum, sizeof(header->chksum), "%06o", chksum);
+}
+
+/**
+ * Overwrites the size field of the header at the given offset of an archive, keeping its checksum valid.
+ */
+void write_size(int fd, off_t offset, char *size)
+{
+	tar_header_t header;
+	cr_assert_eq(pread(fd, &header, sizeof(header), offset), sizeof(header), "pread() failed");
+	memset(header.size, 0, sizeof(header.size));
+	strncpy(header.size, size, sizeof(header.size) - 1);
+	write_chksum(&header);
+	cr_assert_eq(pwrite(fd, &header, sizeof(header), offset), sizeof(header), "pwrite() failed");
+}
+
+/**
+ * Writes an entry at the given offset of an archive, followed by an end-of-archive marker,
+ * the same way `tar --append` does.
+ *
+ * @return the offset of the new end-of-archive marker.
+ */
+off_t write_entry(int fd, off_t offset, char *name, char typeflag, char *linkname, char *content)
+{
+	tar_header_t header;
+	memset(&header, 0, sizeof(header));
+
+	size_t size = content != NULL ? strlen(content) : 0;
+	strncpy(header.name, name, sizeof(header.name) - 1);
+	strcpy(header.mode, "0000644");
+	strcpy(header.uid, "0000000");
+	strcpy(header.gid, "0000000");
+	snprintf(header.size, sizeof(header.size), "%011o", (unsigned int)size);
+	strcpy(header.mtime, "00000000000");
+	header.typeflag = typeflag;
+	if (linkname != NULL)
+		strncpy(header.linkname, linkname, sizeof(header.linkname) - 1);
+	memcpy(header.magic, TMAGIC, TMAGLEN);
+	memcpy(header.version, TVERSION, TVERSLEN);
+
+	write_chksum(&header);
+
+	uint8_t block[512];
+	size_t blocks = (size + 511) / 512;
+	cr_assert_eq(pwrite(fd, &header, sizeof(header), offset), sizeof(header), "pwrite() failed");
+	offset += sizeof(header);
+	for (size_t i = 0; i < blocks; i++, offset += sizeof(block))
+	{
+		memset(block, 0, sizeof(block));
+		memcpy(block, content + i * 512, size - i * 512 < 512 ? size - i * 512 : 512);
+		cr_assert_eq(pwrite(fd, block, sizeof(block), offset), sizeof(block), "pwrite() failed");
+	}
+
+	memset(block, 0, sizeof(block));
+	cr_assert_eq(pwrite(fd, block, sizeof(block), offset), sizeof(block), "pwrite() failed");
+	cr_assert_eq(pwrite(fd, block, sizeof(block), offset + sizeof(block)), sizeof(block), "pwrite() failed");
+	return offset;
+}
+
 #endif // __HELPERS_H__
@@ -20,8 +20,13 @@
  * 6 directories, 8 files
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <criterion/criterion.h>
 
@@ -52,6 +57,41 @@ Test(TS_dir1, check_archive)
 	test_check_archive(fd, "tests/bin/test_dir1.tar", 15);
 }
 
+Test(TS_dir1, check_archive_direct)
+{
+	cr_assert_eq(check_archive_direct("tests/bin/test_dir1.tar"), 15, "check_archive_direct() failed");
+	cr_assert_eq(check_archive_direct("tests/bin/missing.tar"), -4, "check_archive_direct('missing.tar') failed");
+
+	// An entry whose content spans both buffers, followed by another one
+	int copy_fd = copy_archive(fd);
+	size_t size = 5 * 1024 * 1024;
+	char *content = (char *)malloc(size + 1);
+	memset(content, 'a', size);
+	content[size] = '\0';
+	off_t end = write_entry(copy_fd, header_offset(copy_fd, NULL), "big.txt", REGTYPE, NULL, content);
+	write_entry(copy_fd, end, "after.txt", REGTYPE, NULL, "after");
+	free(content);
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", copy_fd);
+	cr_assert_eq(check_archive_direct(path), 17, "check_archive_direct(copy) failed");
+
+	cr_assert_eq(pwrite(copy_fd, "0000000", 7, header_offset(copy_fd, "after.txt") + 148), 7, "pwrite() failed");
+	cr_assert_eq(check_archive_direct(path), -3, "check_archive_direct(corrupted) failed");
+
+	// A negative size must not skip the rest of the archive
+	write_entry(copy_fd, header_offset(copy_fd, "after.txt"), "after.txt", REGTYPE, NULL, "after");
+	write_size(copy_fd, header_offset(copy_fd, "big.txt"), "-0000001000");
+	cr_assert_eq(check_archive_direct(path), -3, "check_archive_direct(negative size) failed");
+
+	// A truncated archive must not be counted up to its last header
+	write_size(copy_fd, header_offset(copy_fd, "big.txt"), "00024000000");
+	cr_assert_eq(check_archive_direct(path), 17, "check_archive_direct(copy) failed");
+	cr_assert_eq(ftruncate(copy_fd, header_offset(copy_fd, "big.txt") + 1024 * 1024), 0, "ftruncate() failed");
+	cr_assert_eq(check_archive_direct(path), -3, "check_archive_direct(truncated) failed");
+	close(copy_fd);
+}
+
 Test(TS_dir1, exists)
 {
 	test_exists(fd, "file0.txt", 1, 1, 0, 0);
@@ -119,3 +159,486 @@ Test(TS_dir1, list)
 	test_list(fd, "dir1", 0, NULL);
 	test_list(fd, "", 0, NULL);
 }
+
+Test(TS_dir1, index)
+{
+	tar_index_t *index = tar_index_open(fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+
+	cr_assert(tar_index_is_file(index, "dir1/file1.txt"), "tar_index_is_file('dir1/file1.txt') failed");
+	cr_assert(tar_index_is_dir(index, "dir1/subdir1/"), "tar_index_is_dir('dir1/subdir1/') failed");
+	cr_assert(tar_index_is_symlink(index, "symlink_subdir1"), "tar_index_is_symlink('symlink_subdir1') failed");
+	cr_assert(!tar_index_exists(index, "symlink_subdir1/subfile1.txt"), "tar_index_exists('symlink_subdir1/subfile1.txt') failed");
+
+	uint8_t buf[19];
+	size_t len = sizeof(buf);
+	cr_assert_eq(tar_index_read_file(index, "symlink2", 0, buf, &len), 8, "tar_index_read_file('symlink2') failed");
+	cr_assert(len == sizeof(buf) && memcmp(buf, "Hello, again!\nHow a", len) == 0, "tar_index_read_file('symlink2') failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+	cr_assert_eq(tar_index_list(index, "symlink_symlink_subdir1", entries, &no_entries), 3, "tar_index_list('symlink_symlink_subdir1') failed");
+
+	tar_index_close(index);
+}
+
+Test(TS_dir1, index_refresh)
+{
+	int copy_fd = copy_archive(fd);
+	tar_index_t *index = tar_index_open(copy_fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+	cr_assert_eq(tar_index_refresh(index), 0, "tar_index_refresh() failed");
+
+	off_t end = header_offset(copy_fd, NULL);
+	end = write_entry(copy_fd, end, "file0.txt", REGTYPE, NULL, "appended\n");
+	end = write_entry(copy_fd, end, "dir3/", DIRTYPE, NULL, NULL);
+	cr_assert(!tar_index_exists(index, "dir3/"), "tar_index_exists('dir3/') failed");
+	cr_assert_eq(tar_index_refresh(index), 2, "tar_index_refresh() failed");
+	cr_assert(tar_index_is_dir(index, "dir3/"), "tar_index_is_dir('dir3/') failed");
+
+	// The appended entry shadows the original one
+	uint8_t buf[16];
+	size_t len = sizeof(buf);
+	cr_assert_eq(tar_index_read_file(index, "file0.txt", 0, buf, &len), 0, "tar_index_read_file('file0.txt') failed");
+	cr_assert(len == 9 && memcmp(buf, "appended\n", len) == 0, "tar_index_read_file('file0.txt') failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+	write_entry(copy_fd, end, "dir3/file3.txt", REGTYPE, NULL, "");
+	cr_assert_eq(tar_index_refresh(index), 1, "tar_index_refresh() failed");
+	cr_assert_eq(tar_index_list(index, "dir3/", entries, &no_entries), 1, "tar_index_list('dir3/') failed");
+
+	// An entry is left for a later refresh until the block after its content is written
+	char content[2000];
+	memset(content, 'a', sizeof(content) - 1);
+	content[sizeof(content) - 1] = '\0';
+	end = header_offset(copy_fd, NULL);
+	off_t next = write_entry(copy_fd, end, "file4.txt", REGTYPE, NULL, content);
+	cr_assert_eq(ftruncate(copy_fd, next), 0, "ftruncate() failed");
+	cr_assert_eq(tar_index_refresh(index), 0, "tar_index_refresh() failed");
+	write_entry(copy_fd, end, "file4.txt", REGTYPE, NULL, content);
+	cr_assert_eq(tar_index_refresh(index), 1, "tar_index_refresh() failed");
+	cr_assert(tar_index_is_file(index, "file4.txt"), "tar_index_is_file('file4.txt') failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+Test(TS_dir1, index_invalid_size)
+{
+	int copy_fd = copy_archive(fd);
+	off_t offset = header_offset(copy_fd, "dir2/file2.txt");
+
+	// A negative size would not move the scan forward
+	write_size(copy_fd, offset, "-0000002000");
+	cr_assert_null(tar_index_open(copy_fd, 0), "tar_index_open() failed");
+
+	write_size(copy_fd, offset, "77777777777");
+	cr_assert_null(tar_index_open(copy_fd, 0), "tar_index_open() failed");
+
+	// Appended entries are checked too
+	close(copy_fd);
+	copy_fd = copy_archive(fd);
+	tar_index_t *index = tar_index_open(copy_fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+	off_t end = header_offset(copy_fd, NULL);
+	write_entry(copy_fd, end, "file0.txt", REGTYPE, NULL, "appended\n");
+	write_size(copy_fd, end, "-0000001000");
+	cr_assert_eq(tar_index_refresh(index), -3, "tar_index_refresh() failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+Test(TS_dir1, index_lazy)
+{
+	int copy_fd = copy_archive(fd);
+	cr_assert_eq(pwrite(copy_fd, "0000000", 7, header_offset(copy_fd, "dir2/file2.txt") + 148), 7, "pwrite() failed");
+
+	cr_assert_null(tar_index_open(copy_fd, 0), "tar_index_open() failed");
+	tar_index_t *index = tar_index_open(copy_fd, TAR_INDEX_LAZY);
+	cr_assert_not_null(index, "tar_index_open(TAR_INDEX_LAZY) failed");
+
+	// Only the lookups reaching the corrupted header fail
+	uint8_t buf[16];
+	size_t len = sizeof(buf);
+	cr_assert_eq(tar_index_read_file(index, "symlink1", 0, buf, &len), 0, "tar_index_read_file('symlink1') failed");
+	cr_assert_eq(tar_index_is_file(index, "dir2/file2.txt"), -3, "tar_index_is_file('dir2/file2.txt') failed");
+	cr_assert_eq(tar_index_read_file(index, "symlink2", 0, buf, &len), -3, "tar_index_read_file('symlink2') failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+	cr_assert_eq(tar_index_list(index, "dir2/", entries, &no_entries), -3, "tar_index_list('dir2/') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_index_list(index, "dir1/", entries, &no_entries), 3, "tar_index_list('dir1/') failed");
+
+	// A header that cannot be read is not mistaken for an invalid one
+	int dir_fd = open("tests", O_RDONLY);
+	cr_assert_neq(dup2(dir_fd, copy_fd), -1, "dup2() failed");
+	close(dir_fd);
+	cr_assert_eq(tar_index_exists(index, "file0.txt"), -4, "tar_index_exists('file0.txt') failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+	copy_fd = copy_archive(fd);
+
+	// The size of a header that is not validated is still checked, its field not even being null-terminated
+	cr_assert_eq(pwrite(copy_fd, "-00000020000", 12, header_offset(copy_fd, "dir2/file2.txt") + 124), 12, "pwrite() failed");
+	cr_assert_null(tar_index_open(copy_fd, TAR_INDEX_LAZY), "tar_index_open(TAR_INDEX_LAZY) failed");
+	cr_assert_eq(pwrite(copy_fd, "777777777777", 12, header_offset(copy_fd, "dir2/file2.txt") + 124), 12, "pwrite() failed");
+	cr_assert_null(tar_index_open(copy_fd, TAR_INDEX_LAZY), "tar_index_open(TAR_INDEX_LAZY) failed");
+	close(copy_fd);
+}
+
+Test(TS_dir1, glob)
+{
+	tar_index_t *index = tar_index_open(fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+
+	char *prefix_dir1_subdir1[] = {"dir1/subdir1/", "dir1/subdir1/subfile1.txt", "dir1/subdir1/subfile2.txt",
+								   "dir1/subdir1/subsubdir1/", "dir1/subdir1/subsubdir1/.gitkeep"};
+	cr_assert_eq(tar_find_prefix(index, "dir1/subdir1/", 0, entries, &no_entries), 5, "tar_find_prefix('dir1/subdir1/') failed");
+	for (size_t i = 0; i < no_entries; i++)
+		cr_assert_str_eq(entries[i], prefix_dir1_subdir1[i], "tar_find_prefix('dir1/subdir1/') failed");
+
+	no_entries = 2;
+	cr_assert_eq(tar_find_prefix(index, "symlink", 0, entries, &no_entries), 2, "tar_find_prefix('symlink') failed");
+	cr_assert_str_eq(entries[1], "symlink2", "tar_find_prefix('symlink') failed");
+
+	char *glob_txt[] = {"dir1/file1.txt", "dir1/file2.txt", "dir2/file2.txt"};
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir?/*.txt", 0, entries, &no_entries), 3, "tar_glob('dir?/*.txt') failed");
+	for (size_t i = 0; i < no_entries; i++)
+		cr_assert_str_eq(entries[i], glob_txt[i], "tar_glob('dir?/*.txt') failed");
+
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir1/**.txt", 0, entries, &no_entries), 4, "tar_glob('dir1/**.txt') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "**/subdir1", 0, entries, &no_entries), 1, "tar_glob('**/subdir1') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "*", 0, entries, &no_entries), 7, "tar_glob('*') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir3/*", 0, entries, &no_entries), 0, "tar_glob('dir3/*') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "**/file0.txt", 0, entries, &no_entries), 1, "tar_glob('**/file0.txt') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "**/file2.txt", 0, entries, &no_entries), 2, "tar_glob('**/file2.txt') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir1/**/.gitkeep", 0, entries, &no_entries), 1, "tar_glob('dir1/**/.gitkeep') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir1/sub*/sub*1.txt", 0, entries, &no_entries), 1, "tar_glob('dir1/sub*/sub*1.txt') failed");
+	cr_assert_str_eq(entries[0], "dir1/subdir1/subfile1.txt", "tar_glob('dir1/sub*/sub*1.txt') failed");
+
+	// A directory is not listed by the pattern of its content, but a pattern ending with a slash only lists directories
+	char *glob_dir1[] = {"dir1/file1.txt", "dir1/file2.txt", "dir1/subdir1/"};
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir1/*", 0, entries, &no_entries), 3, "tar_glob('dir1/*') failed");
+	for (size_t i = 0; i < no_entries; i++)
+		cr_assert_str_eq(entries[i], glob_dir1[i], "tar_glob('dir1/*') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir1/*/", 0, entries, &no_entries), 1, "tar_glob('dir1/*/') failed");
+	cr_assert_str_eq(entries[0], "dir1/subdir1/", "tar_glob('dir1/*/') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "*/", 0, entries, &no_entries), 2, "tar_glob('*/') failed");
+
+	tar_index_close(index);
+}
+
+Test(TS_dir1, glob_backtracking)
+{
+	int copy_fd = copy_archive(fd);
+	char name[99];
+	memset(name, 'a', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	write_entry(copy_fd, header_offset(copy_fd, NULL), name, REGTYPE, NULL, "");
+	tar_index_t *index = tar_index_open(copy_fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+
+	// Patterns that only fail at their last character must not try every way to match their stars
+	size_t no_entries = 10;
+	cr_assert_eq(tar_glob(index, "*a*a*a*a*a*a*a*a*b", 0, entries, &no_entries), 0, "tar_glob('*a*a*a*a*a*a*a*a*b') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "**a**a**a**a**a**a**a**a**b", 0, entries, &no_entries), 0, "tar_glob('**a**a**a**a**a**a**a**a**b') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "*a*a*a*a*a*a*a*a", 0, entries, &no_entries), 1, "tar_glob('*a*a*a*a*a*a*a*a') failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+Test(TS_dir1, glob_archive_order)
+{
+	int copy_fd = copy_archive(fd);
+	tar_index_t *index = tar_index_open(copy_fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+
+	write_entry(copy_fd, header_offset(copy_fd, NULL), "dir1/file0.txt", REGTYPE, NULL, "");
+	cr_assert_eq(tar_index_refresh(index), 1, "tar_index_refresh() failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+
+	cr_assert_eq(tar_glob(index, "dir1/file*", TAR_ARCHIVE_ORDER, entries, &no_entries), 3, "tar_glob('dir1/file*') failed");
+	cr_assert_str_eq(entries[2], "dir1/file0.txt", "tar_glob('dir1/file*') failed");
+	no_entries = 10;
+	cr_assert_eq(tar_glob(index, "dir1/file*", 0, entries, &no_entries), 3, "tar_glob('dir1/file*') failed");
+	cr_assert_str_eq(entries[0], "dir1/file0.txt", "tar_glob('dir1/file*') failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+Test(TS_dir1, hard_link)
+{
+	int copy_fd = copy_archive(fd);
+	off_t end = header_offset(copy_fd, NULL);
+	end = write_entry(copy_fd, end, "hard_link1", LNKTYPE, "dir1/file1.txt", NULL);
+	end = write_entry(copy_fd, end, "hard_link2", LNKTYPE, "hard_link1", NULL);
+	end = write_entry(copy_fd, end, "hard_link3", LNKTYPE, "missing.txt", NULL);
+	write_entry(copy_fd, end, "hard_link4", LNKTYPE, "dir1/", NULL);
+
+	test_exists(copy_fd, "hard_link1", 1, 1, 0, 0);
+	test_exists(copy_fd, "hard_link2", 1, 1, 0, 0);
+	test_exists(copy_fd, "hard_link3", 1, 0, 0, 0);
+	test_exists(copy_fd, "hard_link4", 1, 0, 0, 0);
+	test_read_file(copy_fd, "hard_link1", 7, 14, 0, "World!\n");
+
+	tar_index_t *index = tar_index_open(copy_fd, TAR_INDEX_CACHE);
+	cr_assert_not_null(index, "tar_index_open(TAR_INDEX_CACHE) failed");
+	cr_assert(tar_index_is_file(index, "hard_link2"), "tar_index_is_file('hard_link2') failed");
+	cr_assert(!tar_index_is_file(index, "hard_link3"), "tar_index_is_file('hard_link3') failed");
+	cr_assert(!tar_index_is_file(index, "hard_link4"), "tar_index_is_file('hard_link4') failed");
+
+	char *paths[] = {"dir1/file1.txt", "hard_link1", "hard_link2"};
+	for (size_t i = 0; i < 3; i++)
+	{
+		uint8_t buf[16];
+		size_t len = 5;
+		cr_assert_eq(tar_index_read_file(index, paths[i], 7, buf, &len), 2, "tar_index_read_file('%s') failed", paths[i]);
+		cr_assert(len == 5 && memcmp(buf, "World", len) == 0, "tar_index_read_file('%s') failed", paths[i]);
+	}
+
+	uint8_t buf[16];
+	size_t len = sizeof(buf);
+	cr_assert_eq(tar_index_read_file(index, "hard_link3", 0, buf, &len), -1, "tar_index_read_file('hard_link3') failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+Test(TS_dir1, link_loop)
+{
+	int copy_fd = copy_archive(fd);
+	off_t end = header_offset(copy_fd, NULL);
+	end = write_entry(copy_fd, end, "self_link", LNKTYPE, "self_link", NULL);
+	end = write_entry(copy_fd, end, "loop1", SYMTYPE, "loop2", NULL);
+	write_entry(copy_fd, end, "loop2", SYMTYPE, "loop1", NULL);
+
+	uint8_t buf[16];
+	size_t len = sizeof(buf);
+	struct iovec iov[] = {{buf, sizeof(buf)}};
+	cr_assert_eq(read_file(copy_fd, "self_link", 0, buf, &len), -1, "read_file('self_link') failed");
+	cr_assert_eq(read_file_v(copy_fd, "self_link", 0, iov, 1, &len), -1, "read_file_v('self_link') failed");
+	cr_assert_eq(read_file_to_fd(copy_fd, "self_link", 0, copy_fd, &len), -1, "read_file_to_fd('self_link') failed");
+	cr_assert_eq(read_file(copy_fd, "loop1", 0, buf, &len), -1, "read_file('loop1') failed");
+	test_list(copy_fd, "loop1", 0, NULL);
+
+	close(copy_fd);
+}
+
+Test(TS_dir1, read_file_v)
+{
+	char head[7], tail[16];
+	struct iovec iov[] = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+	size_t len;
+
+	cr_assert_eq(read_file_v(fd, "symlink1", 0, iov, 2, &len), 0, "read_file_v('symlink1') failed");
+	cr_assert(len == 14 && memcmp(head, "Hello, ", 7) == 0 && memcmp(tail, "World!\n", 7) == 0, "read_file_v('symlink1') failed");
+	cr_assert_eq(read_file_v(fd, "dir2/file2.txt", 0, iov, 1, &len), 20, "read_file_v('dir2/file2.txt') failed");
+	cr_assert_eq(read_file_v(fd, "dir1/", 0, iov, 2, &len), -1, "read_file_v('dir1/') failed");
+	cr_assert_eq(read_file_v(fd, "symlink1", 0, iov, -1, &len), -1, "read_file_v('symlink1') failed");
+	cr_assert_eq(read_file_v(fd, "symlink1", 0, iov, INT_MAX, &len), -1, "read_file_v('symlink1') failed");
+
+	tar_index_t *index = tar_index_open(fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+	cr_assert_eq(tar_index_read_file_v(index, "dir1/file1.txt", 7, iov, 2, &len), 0, "tar_index_read_file_v('dir1/file1.txt') failed");
+	cr_assert(len == 7 && memcmp(head, "World!\n", 7) == 0, "tar_index_read_file_v('dir1/file1.txt') failed");
+	cr_assert_eq(tar_index_read_file_v(index, "dir1/file1.txt", 0, iov, INT_MAX, &len), -1, "tar_index_read_file_v('dir1/file1.txt') failed");
+	tar_index_close(index);
+}
+
+Test(TS_dir1, read_file_to_fd)
+{
+	int pipe_fds[2];
+	cr_assert_eq(pipe(pipe_fds), 0, "pipe() failed");
+
+	char buf[32];
+	size_t len = 5;
+	cr_assert_eq(read_file_to_fd(fd, "dir1/file1.txt", 7, pipe_fds[1], &len), 2, "read_file_to_fd('dir1/file1.txt') failed");
+	cr_assert(len == 5 && read(pipe_fds[0], buf, sizeof(buf)) == 5 && memcmp(buf, "World", 5) == 0, "read_file_to_fd('dir1/file1.txt') failed");
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+
+	int out_fd = copy_archive(fd);
+	off_t end = lseek(out_fd, 0, SEEK_END);
+	tar_index_t *index = tar_index_open(fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+	len = sizeof(buf);
+	cr_assert_eq(tar_index_read_file_to_fd(index, "symlink1", 0, out_fd, &len), 0, "tar_index_read_file_to_fd('symlink1') failed");
+	cr_assert(len == 14 && pread(out_fd, buf, sizeof(buf), end) == 14 && memcmp(buf, "Hello, World!\n", 14) == 0,
+			  "tar_index_read_file_to_fd('symlink1') failed");
+	tar_index_close(index);
+	close(out_fd);
+}
+
+Test(TS_dir1, index_many_entries)
+{
+	int copy_fd = copy_archive(fd);
+	off_t end = header_offset(copy_fd, NULL);
+	for (int i = 39; i >= 0; i--)
+	{
+		char path[32];
+		snprintf(path, sizeof(path), "dir1/subdir1/file_%02d.txt", i);
+		end = write_entry(copy_fd, end, path, REGTYPE, NULL, path);
+	}
+
+	tar_index_t *index = tar_index_open(copy_fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+
+	char *entries[40];
+	for (size_t i = 0; i < 40; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 40;
+	cr_assert_eq(tar_glob(index, "dir1/subdir1/file_*", 0, entries, &no_entries), 40, "tar_glob('dir1/subdir1/file_*') failed");
+
+	for (size_t i = 0; i < no_entries; i++)
+	{
+		char path[32];
+		snprintf(path, sizeof(path), "dir1/subdir1/file_%02zu.txt", i);
+		cr_assert_str_eq(entries[i], path, "tar_glob('dir1/subdir1/file_*') failed");
+
+		uint8_t buf[32];
+		size_t len = sizeof(buf);
+		cr_assert_eq(tar_index_read_file(index, path, 0, buf, &len), 0, "tar_index_read_file('%s') failed", path);
+		cr_assert(len == strlen(path) && memcmp(buf, path, len) == 0, "tar_index_read_file('%s') failed", path);
+	}
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+double cpu_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Test(TS_dir1, glob_after_refresh)
+{
+	int copy_fd = copy_archive(fd);
+	off_t end = header_offset(copy_fd, NULL);
+	for (int i = 0; i < 4000; i++)
+	{
+		char path[32];
+		snprintf(path, sizeof(path), "dir4/file_%04d.txt", (i * 7919) % 4000);
+		end = write_entry(copy_fd, end, path, REGTYPE, NULL, NULL);
+	}
+	tar_index_t *index = tar_index_open(copy_fd, 0);
+	cr_assert_not_null(index, "tar_index_open() failed");
+
+	char *entries[4100];
+	for (size_t i = 0; i < 4100; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+	double start = cpu_time();
+	cr_assert_eq(tar_glob(index, "dir1/file*", 0, entries, &no_entries), 2, "tar_glob('dir1/file*') failed");
+	double sort_time = cpu_time() - start;
+
+	// A few appended entries are put in place, new ones or ones shadowing a previous entry,
+	// without sorting the whole table again for each query
+	double refresh_time = 0;
+	for (int i = 0; i < 20; i++)
+	{
+		char path[32];
+		snprintf(path, sizeof(path), i % 2 ? "dir4/file_%04d.txt" : "dir4/new_%04d.txt", i * 13);
+		end = write_entry(copy_fd, end, path, REGTYPE, NULL, NULL);
+		start = cpu_time();
+		cr_assert_eq(tar_index_refresh(index), 1, "tar_index_refresh() failed");
+		no_entries = 10;
+		cr_assert_eq(tar_glob(index, "dir1/file*", 0, entries, &no_entries), 2, "tar_glob('dir1/file*') failed");
+		refresh_time += cpu_time() - start;
+	}
+	cr_assert(refresh_time < 4 * sort_time, "tar_glob() sorted the whole table again after a refresh");
+
+	no_entries = 4100;
+	cr_assert_eq(tar_find_prefix(index, "dir4/", 0, entries, &no_entries), 4010, "tar_find_prefix('dir4/') failed");
+	for (size_t i = 1; i < no_entries; i++)
+		cr_assert(strcmp(entries[i - 1], entries[i]) < 0, "tar_find_prefix('dir4/') failed");
+
+	tar_index_close(index);
+	close(copy_fd);
+}
+
+void *reload_swap(void *arg)
+{
+	char **args = (char **)arg;
+	cr_assert_eq(tar_swap_reload((tar_swap_t *)args[0], args[1]), 0, "tar_swap_reload('%s') failed", args[1]);
+	return NULL;
+}
+
+Test(TS_dir1, swap)
+{
+	char filename[] = "/tmp/lib_tar_XXXXXX";
+	int new_fd = mkstemp(filename);
+	cr_assert_neq(new_fd, -1, "mkstemp() failed");
+	write_entry(new_fd, 0, "file0.txt", REGTYPE, NULL, "swapped\n");
+
+	tar_swap_t *swap = tar_swap_open("tests/bin/test_dir1.tar");
+	cr_assert_not_null(swap, "tar_swap_open() failed");
+	cr_assert_eq(tar_swap_reload(swap, "/nonexistent.tar"), -1, "tar_swap_reload('/nonexistent.tar') failed");
+
+	// A reader holding the current version keeps reading it while a reload is in progress
+	int epoch;
+	tar_index_t *index = tar_swap_acquire(swap, &epoch);
+	pthread_t reloader;
+	char *args[] = {(char *)swap, filename};
+	pthread_create(&reloader, NULL, reload_swap, args);
+	usleep(10000);
+
+	cr_assert(tar_index_is_dir(index, "dir1/"), "tar_index_is_dir('dir1/') failed");
+	tar_swap_release(swap, epoch);
+	pthread_join(reloader, NULL);
+
+	uint8_t buf[16];
+	size_t len = sizeof(buf);
+	cr_assert_eq(tar_swap_read_file(swap, "file0.txt", 0, buf, &len), 0, "tar_swap_read_file('file0.txt') failed");
+	cr_assert(len == 8 && memcmp(buf, "swapped\n", len) == 0, "tar_swap_read_file('file0.txt') failed");
+
+	char *entries[10];
+	for (size_t i = 0; i < 10; i++)
+		entries[i] = (char *)malloc(sizeof(char) * 256);
+	size_t no_entries = 10;
+	cr_assert_eq(tar_swap_list(swap, "dir1/", entries, &no_entries), 0, "tar_swap_list('dir1/') failed");
+
+	tar_swap_close(swap);
+	close(new_fd);
+	unlink(filename);
+}
@@ -8,6 +8,8 @@
  * 
  * 0 directories, 1 file
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 